@@ -1,9 +1,67 @@
 #pragma once
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
 
 
 struct Streamer;
+struct Source;
+enum class source_kind
+{
+  audio,
+  video
+};
+
+// Format of the audio between the nodes and the encoders: S16 halves the
+// queue and appsrc bandwidth.
+enum class sample_format
+{
+  f32,
+  s16
+};
+
+// How peers find each other. stun: server-reflexive candidates through the
+// STUN server. host_only: local candidates only, nothing to wait on, for
+// LANs. host_udp: host_only without TCP candidates. Both still run full
+// ICE, webrtcbin has no ICE-lite.
+enum class ice_policy
+{
+  stun,
+  host_only,
+  host_udp
+};
+
+// Jitter buffer target viewers are asked to keep, through the playout-delay
+// RTP header extension, in steps of 10 ms up to 40950 ms. Negative leaves
+// it to the browser.
+struct playout_delay
+{
+  int min_ms{-1};
+  int max_ms{-1};
+
+  bool enabled() const noexcept
+  {
+    return min_ms >= 0 && max_ms >= min_ms;
+  }
+};
+
+struct thread_settings
+{
+  // CPUs the threads may run on, empty for any
+  std::vector<int> cpus;
+  // SCHED_FIFO when > 0, otherwise SCHED_OTHER at the given nice level
+  int fifo_priority{};
+  int nice{};
+
+  bool enabled() const noexcept
+  {
+    return !cpus.empty() || fifo_priority > 0 || nice != 0;
+  }
+};
+
 struct config
 {
   int port;
@@ -11,6 +69,113 @@ struct config
 
   int rate{};
   int frames{};
+
+  // How long a WHEP answer waits for ICE candidates to be gathered
+  int whep_ice_timeout_ms{250};
+  // How long a WHEP session stays disconnected before it is dropped; failed
+  // or closed ones go right away. Players leaving do not always DELETE.
+  int whep_disconnect_timeout_ms{10000};
+
+  ice_policy ice{ice_policy::stun};
+  std::string stun_server{"stun.l.google.com:19302"};
+  // Fixed UDP port range for the peers, e.g. to open in a firewall. With a
+  // non-stun policy or a range, each peer bundles everything on one socket.
+  int ice_min_port{};
+  int ice_max_port{};
+
+  // Admission control, 0 for no limit: the CPU viewers may use on top of
+  // the host's own, in cores; their total outgoing bitrate; their count.
+  // New viewers get a lower rendition, then audio only, before being
+  // turned away with a 503.
+  double cpu_budget{};
+  int bandwidth_budget_kbps{};
+  int max_viewers{};
+
+  // How long a websocket viewer's session outlives its websocket, so that
+  // it can resume with only an ICE restart, e.g. after changing networks.
+  // A closed tab looks the same: its encoders keep running, and count
+  // against the admission budgets, for that long. 0, the default, tears
+  // sessions down right away.
+  int resume_grace_ms{};
+
+  // Low for interactive feeds, higher for smooth ones: per track name,
+  // otherwise the default
+  playout_delay playout;
+  std::map<std::string, playout_delay> track_playout;
+
+  // Host capture time on the first packet of each frame, in the
+  // abs-capture-time RTP header extension, for viewers to measure the
+  // latency end to end. Assumes the clocks of both ends are in sync. Only
+  // written to viewers that negotiated the extension.
+  bool capture_time{false};
+
+  // Duration of the fMP4 fragments sent to viewers without WebRTC. Below a
+  // video frame, each frame is sent on its own as soon as it is muxed.
+  int fmp4_fragment_ms{5};
+
+  // How far an fMP4 viewer may fall behind, in bytes unsent on its socket,
+  // before it skips fragments; it is dropped after a few seconds over.
+  int fmp4_max_queued_bytes{1 << 19};
+
+  // Opus frame size for WebRTC viewers: 2.5, 5, 10, 20, 40 or 60. Audio is
+  // handed to the encoders in buffers of exactly one frame.
+  double opus_frame_ms{2.5};
+
+  // sendrecv: decode what viewers send back, within these jitter buffer bounds
+  bool receive{};
+  int jitter_min_ms{5};
+  int jitter_max_ms{200};
+
+  // Thread topology: the Streamer main loop; the video conversion and
+  // encoding threads, x264's included; everything else GStreamer, webrtcbin
+  // and libnice run. 0 x264 threads lets x264 decide. API only, as the
+  // rest of this config: see make_streamer. witchbridge-bench-jitter
+  // compares them under encoding load.
+  thread_settings streamer_thread;
+  thread_settings encoder_threads;
+  thread_settings network_threads;
+  int x264_threads{};
+  bool x264_sliced_threads{};
+
+  // Sender priority of each kind: "very-low", "low", "medium" or "high".
+  // Empty leaves the default. This is the sender priority only: packets are
+  // not marked with a DSCP, per kind or otherwise. That would need a
+  // transport per kind, which max-bundle rules out, and is not implemented.
+  std::string audio_priority{"high"};
+  std::string video_priority{"low"};
+
+  // Time the main loop may spend handing video frames to the encoders per
+  // round, before it gets back to audio. The frames left wait for the next
+  // round, 1 ms later, where only the latest one is sent.
+  int video_budget_us{2000};
+
+  // Send-side pacing of the video packets, against keyframe bursts: they
+  // leave at the viewer's bandwidth estimate, from its RTCP reports,
+  // between the encoder bitrate and this factor times it, delayed by at
+  // most pacer_max_delay_ms. 0 sends them as the payloader outputs them.
+  double pacing_factor{2.5};
+  int pacer_max_delay_ms{33};
+
+  // Local output, for consumers on this machine: each track on its own
+  // shmsink socket in this directory, for shmsrc, listed on /local. Raw
+  // RGBA and audio in the source format, or H.264 byte-stream and Opus.
+  // Empty disables it.
+  std::string local_path;
+  bool local_encoded{};
+
+  // Encoding and serving in a witchbridge-server process, which the nodes
+  // feed through shared memory: the host survives the server crashing,
+  // and the server is restarted. Linux only. Viewers cannot send media
+  // or controls back to the host in this mode.
+  bool out_of_process{};
+  std::string server_path{"witchbridge-server"};
+  // Largest RGBA frame the shared memory takes, larger ones are dropped.
+  // It reserves 256 of them, but only allocates the ones written to.
+  std::size_t shm_frame_bytes{1920 * 1080 * 4};
+
+  // Chrome trace of every block and frame, when built with
+  // WITCHBRIDGE_TRACING: written on /trace and when the server stops
+  std::string trace_path;
 };
 
 struct audio_buffer_view {
@@ -22,9 +187,40 @@ struct video_buffer_view {
   unsigned char* bytes;
   int width, height;
 };
+struct remote_status {
+  float jitter_ms;
+  float latency_ms;
+};
+struct control_message {
+  int channel;
+  float value;
+  float latency_ms;
+};
 
+// The first call creates the Streamer every node shares, with its config;
+// later calls get it as is. The Witchbridge nodes only set rate and frames,
+// and leave the rest, thread topology included, at its defaults: the other
+// fields are for hosts calling this directly.
 std::shared_ptr<Streamer> make_streamer(config c);
 
-void push_audio(Streamer&, audio_buffer_view a);
-void push_video(Streamer&, video_buffer_view a);
+// Each producer registers its own source, and unregisters it by releasing it.
+// Sources are published to the viewers as tracks, under their name.
+std::shared_ptr<Source> register_source(
+    Streamer&,
+    source_kind kind,
+    std::string_view name = {},
+    int channels = 1,
+    sample_format format = sample_format::f32);
+
+// Instantiated for 1 and 2 channels in both formats. The layout has to be
+// the one the source was registered with.
+template <int Channels, sample_format Format>
+void push_audio(Source&, audio_buffer_view a);
+void push_video(Source&, video_buffer_view a);
+bool pop_control(Streamer&, control_message& m);
+
+void pull_audio(Streamer&, const void* owner, audio_buffer_view a);
+bool pull_video(Streamer&, const void* owner, video_buffer_view& v);
+void release_remote(Streamer&, const void* owner);
+remote_status get_remote_status(Streamer&);
 
@@ -0,0 +1,29 @@
+#pragma once
+#include "custom.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+// Interleaves and converts a block in one pass: with the layout known at
+// compile time the inner loop is unrolled and the whole kernel vectorized.
+template <int Channels, sample_format Format>
+inline void interleave(const audio_buffer_view& a, void* out) noexcept
+{
+  using sample_t = std::conditional_t<Format == sample_format::s16, int16_t, float>;
+  auto* __restrict dst = (sample_t*)out;
+  const float* __restrict src[Channels];
+  for(int c = 0; c < Channels; c++)
+    src[c] = a.audio[c];
+
+  const int frames = a.frames;
+  for(int f = 0; f < frames; f++) {
+    for(int c = 0; c < Channels; c++) {
+      const float x = src[c][f];
+      if constexpr(Format == sample_format::s16)
+        dst[f * Channels + c] = int16_t(std::clamp(x, -1.f, 1.f) * 32767.f);
+      else
+        dst[f * Channels + c] = x;
+    }
+  }
+}
@@ -0,0 +1,229 @@
+#pragma once
+#include "custom.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+
+// Shared memory between a host and its witchbridge-server, in a memfd the
+// host creates and the server inherits. The host side only ever writes
+// media into it; the server encodes and serves it, and can be restarted
+// at any time without the host noticing.
+//
+// The file is sparse: only the pages of the sources in use get allocated.
+// Its size is mostly the video frames, after the header: shm_video_slots
+// per source of config::shm_frame_bytes each.
+
+inline constexpr uint32_t shm_magic = 0x57427368;
+inline constexpr uint32_t shm_version = 1;
+inline constexpr int shm_max_sources = 64;
+// About a second of stereo F32 at 48 kHz
+inline constexpr std::size_t shm_audio_bytes = 1 << 19;
+// One being written, the latest one, and the ones the encoders still read
+inline constexpr int shm_video_slots = 4;
+inline constexpr std::size_t shm_config_bytes = 1 << 14;
+
+// Source slot states, as for in-process sources: the host claims and
+// activates, the server frees once it saw the host close it
+enum shm_state : int
+{
+  shm_free,
+  shm_claimed,
+  shm_active,
+  shm_closing
+};
+
+inline constexpr uint32_t shm_writer_ref = 1u << 31;
+
+struct shm_video_slot
+{
+  // Frames the server has in flight, plus shm_writer_ref while the host
+  // fills the slot: the host only writes slots nobody references.
+  std::atomic<uint32_t> refs;
+  uint64_t seq;
+  int64_t capture_us;
+  int width, height;
+  // Of its frame, from the start of the shared memory
+  uint64_t offset;
+};
+
+struct shm_source
+{
+  std::atomic<int> state;
+  std::atomic<uint32_t> generation;
+  source_kind kind;
+  int channels;
+  sample_format format;
+  char name[64];
+
+  // Audio, interleaved in the source format: single producer, single
+  // consumer byte ring. The capture time is the one of the last write.
+  alignas(64) std::atomic<uint64_t> audio_write;
+  std::atomic<int64_t> audio_capture_us;
+  alignas(64) std::atomic<uint64_t> audio_read;
+  alignas(64) unsigned char audio[shm_audio_bytes];
+
+  // Video: the latest published slot, -1 if none
+  std::atomic<int> video_latest{-1};
+  std::atomic<uint64_t> video_frames_dropped;
+  shm_video_slot video[shm_video_slots];
+};
+
+struct shm_header
+{
+  uint32_t magic;
+  uint32_t version;
+  // Of this header, then of each video slot and of the whole memory
+  uint64_t size;
+  uint64_t frame_bytes;
+  uint64_t total_size;
+  std::atomic<int> server_pid;
+  std::atomic<uint64_t> server_starts;
+  // The host config, as JSON, null-terminated
+  char config_json[shm_config_bytes];
+  shm_source sources[shm_max_sources];
+};
+
+inline std::size_t shm_total_size(std::size_t frame_bytes) noexcept
+{
+  return sizeof(shm_header) + std::size_t(shm_max_sources) * shm_video_slots * frame_bytes;
+}
+
+inline unsigned char* shm_frame_data(shm_header& shm, const shm_video_slot& slot) noexcept
+{
+  return (unsigned char*)&shm + slot.offset;
+}
+
+//// Audio ring
+
+// Where the next size bytes go: first_size of them at first, the rest at
+// the start of the ring. Writes are whole frames, and so is each part.
+struct shm_audio_span
+{
+  unsigned char* first;
+  std::size_t first_size;
+};
+
+// None when the server is not keeping up
+inline std::optional<shm_audio_span> shm_audio_reserve(shm_source& s, std::size_t size) noexcept
+{
+  const uint64_t w = s.audio_write.load(std::memory_order_relaxed);
+  const uint64_t r = s.audio_read.load(std::memory_order_acquire);
+  if (shm_audio_bytes - (w - r) < size)
+    return std::nullopt;
+  const std::size_t at = w % shm_audio_bytes;
+  return shm_audio_span{s.audio + at, std::min(size, shm_audio_bytes - at)};
+}
+
+// Whole blocks or nothing: false when the server is not keeping up
+inline bool shm_audio_write(shm_source& s, const void* data, std::size_t size) noexcept
+{
+  const uint64_t w = s.audio_write.load(std::memory_order_relaxed);
+  const uint64_t r = s.audio_read.load(std::memory_order_acquire);
+  if (shm_audio_bytes - (w - r) < size)
+    return false;
+
+  const std::size_t at = w % shm_audio_bytes;
+  const std::size_t first = std::min(size, shm_audio_bytes - at);
+  memcpy(s.audio + at, data, first);
+  memcpy(s.audio, (const unsigned char*)data + first, size - first);
+  return true;
+}
+
+inline void shm_audio_commit(shm_source& s, std::size_t size, int64_t capture_us) noexcept
+{
+  s.audio_capture_us.store(capture_us, std::memory_order_relaxed);
+  s.audio_write.fetch_add(size, std::memory_order_release);
+}
+
+inline std::size_t shm_audio_available(shm_source& s) noexcept
+{
+  return s.audio_write.load(std::memory_order_acquire)
+         - s.audio_read.load(std::memory_order_relaxed);
+}
+
+// Hands up to max bytes to sink(data, size), in two parts when they wrap
+// around the ring; returns the bytes read
+template <typename Sink>
+inline std::size_t shm_audio_read(shm_source& s, std::size_t max, Sink&& sink)
+{
+  const uint64_t r = s.audio_read.load(std::memory_order_relaxed);
+  const uint64_t w = s.audio_write.load(std::memory_order_acquire);
+  const std::size_t size = std::min<std::size_t>(w - r, max);
+  if (size == 0)
+    return 0;
+
+  const std::size_t at = r % shm_audio_bytes;
+  const std::size_t first = std::min(size, shm_audio_bytes - at);
+  sink(s.audio + at, first);
+  if (size > first)
+    sink(s.audio, size - first);
+  s.audio_read.store(r + size, std::memory_order_release);
+  return size;
+}
+
+//// Video slots
+
+// Host side: a slot that is neither the latest frame nor referenced
+inline shm_video_slot* shm_video_claim(shm_source& s) noexcept
+{
+  const int latest = s.video_latest.load(std::memory_order_acquire);
+  for (int i = 0; i < shm_video_slots; i++)
+  {
+    uint32_t expected = 0;
+    if (i != latest
+        && s.video[i].refs.compare_exchange_strong(expected, shm_writer_ref))
+      return &s.video[i];
+  }
+  return nullptr;
+}
+
+inline void shm_video_publish(shm_source& s, shm_video_slot& slot) noexcept
+{
+  s.video_latest.store(int(&slot - s.video), std::memory_order_release);
+  slot.refs.fetch_sub(shm_writer_ref, std::memory_order_release);
+}
+
+// Server side: a reference to the latest frame, if newer than last_seq.
+// A slot referenced without the writer in it is complete and stays so.
+inline shm_video_slot* shm_video_acquire(shm_source& s, uint64_t last_seq) noexcept
+{
+  const int latest = s.video_latest.load(std::memory_order_acquire);
+  if (latest < 0)
+    return nullptr;
+
+  auto& slot = s.video[latest];
+  const uint32_t refs = slot.refs.fetch_add(1, std::memory_order_acq_rel);
+  if ((refs & shm_writer_ref) || slot.seq <= last_seq)
+  {
+    slot.refs.fetch_sub(1, std::memory_order_release);
+    return nullptr;
+  }
+  return &slot;
+}
+
+inline void shm_video_release(shm_video_slot& slot) noexcept
+{
+  slot.refs.fetch_sub(1, std::memory_order_release);
+}
+
+// What a dead server held is released before the next one starts
+inline void shm_reset_readers(shm_header& shm) noexcept
+{
+  for (auto& src : shm.sources)
+    for (auto& slot : src.video)
+      slot.refs.fetch_and(shm_writer_ref);
+}
+
+//// Server
+
+// Config crossing the process boundary
+std::string config_to_json(const config& c);
+config config_from_json(const char* json);
+
+// Runs a Streamer fed from the shared memory instead of in-process nodes
+std::shared_ptr<Streamer> serve_shared_memory(config c, shm_header& shm);
@@ -0,0 +1,40 @@
+#pragma once
+#include <atomic>
+
+// Lock-free single-producer / single-consumer triple buffer: the writer
+// always has a buffer to fill, the reader always sees the latest complete
+// one, and neither ever waits on the other.
+template <typename T>
+class triple_buffer
+{
+public:
+  // Writer side
+  T& write_buffer() noexcept { return buffers[back]; }
+
+  void publish() noexcept
+  {
+    back = middle.exchange(back | dirty, std::memory_order_acq_rel) & index;
+  }
+
+  // Reader side: returns true if a new buffer was published since the last
+  // call, in which case read_buffer() now refers to it.
+  bool update() noexcept
+  {
+    if (!(middle.load(std::memory_order_relaxed) & dirty))
+      return false;
+
+    front = middle.exchange(front, std::memory_order_acq_rel) & index;
+    return true;
+  }
+
+  T& read_buffer() noexcept { return buffers[front]; }
+
+private:
+  static constexpr int index = 0x3;
+  static constexpr int dirty = 0x4;
+
+  T buffers[3]{};
+  std::atomic_int middle{1};
+  int back{0};
+  int front{2};
+};
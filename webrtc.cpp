@@ -1,15 +1,22 @@
 
 #include "custom.hpp"
+#include "shm_ring.hpp"
+#include "interleave.hpp"
+#include "triple_buffer.hpp"
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/pool/object_pool.hpp>
 
+#include <algorithm>
 #include <cmath>
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/app/gstappsink.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/audio/audio.h>
 #include <gst/video/video.h>
 
 #include <gst/gst.h>
+#include <gst/rtp/rtp.h>
 #include <gst/sdp/sdp.h>
 #include <locale.h>
 
@@ -17,6 +24,20 @@
 #include <glib-unix.h>
 #endif
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #define GST_USE_UNSTABLE_API
 #include <json-glib/json-glib.h>
 
@@ -27,7 +48,6 @@
 #define RTP_PAYLOAD_TYPE "96"
 #define RTP_AUDIO_PAYLOAD_TYPE "97"
 #define SOUP_HTTP_PORT 57778
-#define STUN_SERVER "stun.l.google.com:19302"
 
 #ifdef G_OS_WIN32
 #define VIDEO_SRC "mfvideosrc"
@@ -35,22 +55,41 @@
 #define VIDEO_SRC "videotestsrc is-live=1 "
 #endif
 
+#include <array>
+#include <chrono>
 #include <iostream>
+#include <optional>
+#include <string_view>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 
 #include <rigtorp/SPSCQueue.h>
 #include <boost/circular_buffer.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include <mutex>
 
 
 static constexpr int max_buffer = 4;
 
+// Interleaved, in the transport format of its source
 struct audio_buffer
 {
-  float* audio[2];
+  void* data;
   int channels;
   int frames;
+  uint64_t seq;
+  // Wall clock, when the host pushed it
+  int64_t capture_us;
 };
 
+static constexpr int sample_size(sample_format format) noexcept
+{
+  return format == sample_format::s16 ? sizeof(int16_t) : sizeof(float);
+}
+
 struct audio_frame
 {
   float sample[2];
@@ -60,10 +99,94 @@ struct video_buffer
 {
   unsigned char* bytes;
   int width, height;
+  uint64_t seq;
+  int64_t capture_us;
+  // Out of process: the frame is wrapped where the host wrote it
+  shm_video_slot* slot{};
+};
+
+// Layout of the control messages sent by viewers on the data channel,
+// little-endian. The timestamp is the sender's wall clock in ms since epoch.
+struct wire_control_message
+{
+  uint32_t channel;
+  float value;
+  double timestamp;
+};
+static_assert(sizeof(wire_control_message) == 16);
+
+// Main loop side: bytes accumulated until they make whole encoder frames.
+// The storage is allocated once; a chunk read across its end is put back
+// together in the caller's scratch.
+struct audio_ring
+{
+  std::vector<unsigned char> data;
+  uint64_t read{}, write{};
+
+  std::size_t size() const noexcept { return write - read; }
+  std::size_t space() const noexcept { return data.size() - size(); }
+  void clear() noexcept { read = write = 0; }
+
+  void push(const unsigned char* in, std::size_t n) noexcept
+  {
+    const std::size_t at = write % data.size();
+    const std::size_t first = std::min(n, data.size() - at);
+    memcpy(data.data() + at, in, first);
+    memcpy(data.data(), in + first, n - first);
+    write += n;
+  }
+
+  const unsigned char* peek(std::size_t n, unsigned char* scratch) const noexcept
+  {
+    const std::size_t at = read % data.size();
+    const std::size_t first = data.size() - at;
+    if (n <= first)
+      return data.data() + at;
+    memcpy(scratch, data.data() + at, first);
+    memcpy(scratch + first, data.data(), n - first);
+    return scratch;
+  }
+
+  void pop(std::size_t n) noexcept { read += n; }
+};
+
+// Where a host block starts in the ring, for the chunks starting in it
+struct pending_block
+{
+  uint64_t position;
+  uint64_t seq;
+  int64_t capture_us;
+};
+
+struct video_frame
+{
+  std::vector<unsigned char> bytes;
+  int width{}, height{};
+  uint64_t seq{};
+  int64_t capture_us{};
+};
+
+// Where the media sent back by one viewer ends up, in sendrecv mode.
+// Slots are allocated once and reused, so the host threads can walk them
+// without synchronizing with viewers coming and going.
+struct remote_peer
+{
+  explicit remote_peer(std::size_t samples)
+    : audio(samples)
+  {
+  }
+
+  std::atomic_bool active{};
+  // Interleaved stereo
+  boost::lockfree::spsc_queue<float> audio;
 };
 
-const gchar* video_priority = "low";
-const gchar* audio_priority = "high";
+struct jitterbuffer_state
+{
+  GstElement* element{};
+  guint64 num_late{};
+  double margin_ms{};
+};
 
 struct _GstElement;
 typedef struct _GstElement GstElement;
@@ -72,114 +195,682 @@ typedef struct _SoupWebsocketConnection SoupWebsocketConnection;
 
 #define CHUNK_SIZE 1024*4   /* Amount of bytes we are sending in each buffer */
 struct Streamer;
+
+// Caps of the reference timestamps carrying the host capture time
+static GstCaps* unix_time_caps()
+{
+  static GstCaps* caps = gst_caps_new_empty_simple("timestamp/x-unix");
+  return caps;
+}
+
+//// Tracing
+
+// Each audio block and video frame is identified by its source slot and its
+// sequence number in that source.
+static constexpr uint64_t trace_id(int source, uint64_t seq) noexcept
+{
+  return (uint64_t(source) << 48) | (seq & ((uint64_t(1) << 48) - 1));
+}
+
+#if defined(WITCHBRIDGE_TRACING)
+// Follows every block and frame from the node to webrtcbin, written as a
+// Chrome trace that Perfetto opens: one async slice per frame, with an
+// instant for each stage it went through. Recording is one fetch_add into a
+// fixed buffer; once it is full, later events are dropped.
+struct frame_tracer
+{
+  struct event
+  {
+    const char* stage;
+    uint64_t id;
+    int64_t ts_ns;
+    const void* receiver;
+    int tid;
+    source_kind kind;
+    std::atomic_bool committed;
+  };
+
+  static constexpr std::size_t capacity = 1 << 19;
+  std::unique_ptr<event[]> events;
+  std::atomic<std::size_t> count{};
+  bool enabled{};
+
+  void start()
+  {
+    events = std::make_unique<event[]>(capacity);
+    enabled = true;
+  }
+
+  void record(const char* stage, source_kind kind, uint64_t id, const void* receiver) noexcept
+  {
+    const std::size_t i = count.fetch_add(1, std::memory_order_relaxed);
+    if (i >= capacity)
+      return;
+
+    auto& e = events[i];
+    e.stage = stage;
+    e.id = id;
+    e.ts_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now().time_since_epoch())
+                  .count();
+    e.receiver = receiver;
+#if defined(__linux__)
+    e.tid = gettid();
+#else
+    e.tid = 0;
+#endif
+    e.kind = kind;
+    e.committed.store(true, std::memory_order_release);
+  }
+
+  bool write(const std::string& path) const
+  {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f)
+    {
+      g_warning("Could not write the trace to %s", path.c_str());
+      return false;
+    }
+
+    struct span
+    {
+      int64_t begin = INT64_MAX, end = INT64_MIN;
+      source_kind kind{};
+    };
+    std::unordered_map<uint64_t, span> spans;
+
+    const std::size_t n = std::min(count.load(), capacity);
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (std::size_t i = 0; i < n; i++)
+    {
+      const auto& e = events[i];
+      if (!e.committed.load(std::memory_order_acquire))
+        continue;
+
+      auto& sp = spans[e.id];
+      sp.begin = std::min(sp.begin, e.ts_ns);
+      sp.end = std::max(sp.end, e.ts_ns);
+      sp.kind = e.kind;
+
+      fprintf(
+            f,
+            "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"n\",\"id\":\"0x%" G_GINT64_MODIFIER
+            "x\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"receiver\":\"%p\"}}",
+            first ? "" : ",\n",
+            e.stage,
+            e.kind == source_kind::audio ? "audio" : "video",
+            e.id,
+            e.ts_ns / 1000.,
+            e.tid,
+            e.receiver);
+      first = false;
+    }
+
+    for (const auto& [id, sp] : spans)
+    {
+      const char* cat = sp.kind == source_kind::audio ? "audio" : "video";
+      const int source = int(id >> 48);
+      const uint64_t seq = id & ((uint64_t(1) << 48) - 1);
+      for (auto [ph, ts] : {std::pair{'b', sp.begin}, std::pair{'e', sp.end}})
+        fprintf(
+              f,
+              "%s{\"name\":\"%s %d\",\"cat\":\"%s\",\"ph\":\"%c\",\"id\":\"0x%" G_GINT64_MODIFIER
+              "x\",\"ts\":%.3f,\"pid\":1,\"tid\":0,\"args\":{\"seq\":%" G_GUINT64_FORMAT "}}",
+              first ? "" : ",\n",
+              cat,
+              source,
+              cat,
+              ph,
+              id,
+              ts / 1000.,
+              seq);
+      first = false;
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    if (count.load() > capacity)
+      g_warning("Trace buffer full: %zu events dropped", count.load() - capacity);
+    return true;
+  }
+};
+
+static frame_tracer tracer;
+#endif
+
+// Compiled out without WITCHBRIDGE_TRACING, a branch when disabled
+static inline void trace_event(
+    const char* stage, source_kind kind, uint64_t id, const void* receiver = nullptr) noexcept
+{
+#if defined(WITCHBRIDGE_TRACING)
+  if (tracer.enabled)
+    tracer.record(stage, kind, id, receiver);
+#endif
+}
+
+// Peak rate of a packet stream over short windows, against its mean over
+// the same period: how bursty it is. Fed from one streaming thread, read
+// and reset from the main loop.
+struct burst_meter
+{
+  static constexpr gint64 window_us = 5000;
+
+  void add(gint64 now, gsize size) noexcept
+  {
+    if (now - window_start >= window_us)
+    {
+      window_start = now;
+      window_bytes = 0;
+    }
+    window_bytes += size;
+    if (window_bytes > peak_window_bytes.load(std::memory_order_relaxed))
+      peak_window_bytes.store(window_bytes, std::memory_order_relaxed);
+    bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  gint64 window_start{};
+  uint64_t window_bytes{};
+  std::atomic<uint64_t> peak_window_bytes{};
+  std::atomic<uint64_t> bytes{};
+};
+
+// Leaky bucket between the payloader and webrtcbin: packets leave no
+// faster than the rate, and wait no longer than the maximum delay.
+struct video_pacer
+{
+  // Follows the bandwidth estimate, within the bounds of the rendition
+  std::atomic<double> bytes_per_us{};
+  gint64 max_delay_us{};
+  // Its thread waits on the pipeline clock
+  GstElement* queue{};
+  // That thread only, in clock time
+  GstClockTime next_send{};
+
+  burst_meter before;
+  burst_meter after;
+  std::atomic<gint64> delay_us_max{};
+  std::atomic<uint64_t> overruns{};
+};
+
+// One published track in a receiver pipeline, fed by the source in the
+// same slot as long as it is the same registration. Positions count samples
+// or frames for the timestamps.
+struct track_input
+{
+  int source = -1;
+  uint32_t generation = 0;
+  source_kind kind{};
+  GstElement* appsrc = nullptr;
+  // The webrtcbin sink pad the track is sent on, if any
+  GstPad* webrtc_pad = nullptr;
+  // Audio: buffers of exactly one encoder frame
+  GstBufferPool* pool = nullptr;
+  uint64_t position = 0;
+  int64_t feed{};
+  // Mean jitter buffer delay the viewer last reported, -1 if none
+  double jitter_buffer_ms = -1.;
+  // Video sent over WebRTC, see Streamer::setup_pacer
+  video_pacer pacer;
+  // Encoded output going to the fMP4 muxer, see Streamer::attach_fmp4_tap
+  GstPad* tap_pad = nullptr;
+  GstElement* tap_queue = nullptr;
+  GstElement* tap_sink = nullptr;
+
+  ~track_input()
+  {
+    if (tap_pad)
+      gst_object_unref(tap_pad);
+    if (pool)
+    {
+      gst_buffer_pool_set_active(pool, FALSE);
+      gst_object_unref(pool);
+    }
+    if (webrtc_pad)
+      gst_object_unref(webrtc_pad);
+  }
+
+  // Recently pushed frames, for the probes downstream to find by PTS:
+  // the tracing id and the host capture time, in case the encoders did not
+  // carry the timestamp meta through. Each entry is a seqlock: odd while
+  // being written, readers retry on a sequence change.
+  struct recent_frame
+  {
+    std::atomic<uint32_t> seq{};
+    std::atomic<uint64_t> pts{GST_CLOCK_TIME_NONE};
+    std::atomic<uint64_t> id{};
+    std::atomic<int64_t> capture_us{};
+  };
+  struct frame_info
+  {
+    uint64_t id;
+    int64_t capture_us;
+  };
+  std::array<recent_frame, 64> recent;
+  std::atomic<uint32_t> recent_head{};
+
+  void remember_pts(GstClockTime pts, uint64_t id, int64_t capture_us) noexcept
+  {
+    auto& f = recent[recent_head.fetch_add(1, std::memory_order_relaxed) % recent.size()];
+    const uint32_t seq = f.seq.load(std::memory_order_relaxed);
+    f.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    f.pts.store(pts, std::memory_order_relaxed);
+    f.id.store(id, std::memory_order_relaxed);
+    f.capture_us.store(capture_us, std::memory_order_relaxed);
+    f.seq.store(seq + 2, std::memory_order_release);
+  }
+
+  // Latest frame starting at or before pts: encoders may split blocks
+  std::optional<frame_info> find_recent(GstClockTime pts) const noexcept
+  {
+    std::optional<frame_info> info;
+    GstClockTime best = 0;
+    for (const auto& f : recent)
+    {
+      const uint32_t seq = f.seq.load(std::memory_order_acquire);
+      if (seq & 1)
+        continue;
+      const uint64_t p = f.pts.load(std::memory_order_relaxed);
+      const uint64_t i = f.id.load(std::memory_order_relaxed);
+      const int64_t c = f.capture_us.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (f.seq.load(std::memory_order_relaxed) != seq)
+        continue;
+      if (p == GST_CLOCK_TIME_NONE || p > pts || (info && p < best))
+        continue;
+      best = p;
+      info = frame_info{i, c};
+    }
+    return info;
+  }
+};
+
+// RTP header extension ids of a viewer, per kind, 0 when the extension is
+// not negotiated: ours until the answer is in, those of the offer for WHEP
+// viewers. Read by the payloader probes, see Streamer::write_header_extensions
+struct header_extension_ids
+{
+  std::atomic<int> playout_delay{12};
+  std::atomic<int> capture_time{13};
+};
+
+// What a viewer gets, depending on the load when it joined
+enum class rendition
+{
+  full,
+  low,
+  audio_only
+};
+
 struct ReceiverEntry
 {
   Streamer* self = nullptr;
   SoupWebsocketConnection* connection = nullptr;
+  rendition quality = rendition::full;
+  // WebRTC viewers: in the names of their pipeline threads, and the CPU
+  // those take, see Streamer::update_load
+  int id = 0;
+  double cores = 0.;
 
   GstElement* pipeline = nullptr;
-  GstElement* sound_in = nullptr;
-  GstElement* video_in = nullptr;
+  std::vector<std::unique_ptr<track_input>> tracks;
+  // Names of the tracks this viewer wants, all of them if empty
+  std::vector<std::string> subscription;
   GstElement* webrtcbin = nullptr;
+  GstElement* fmp4_sink = nullptr;
+  // Local output of a single track, see Streamer::create_local_output
+  std::string local_socket;
+  GstWebRTCDataChannel* control_channel = nullptr;
+  int remote_slot = -1;
+  guint bus_watch = 0;
+
+  // Restart bookkeeping, see Streamer::restart_receiver
+  bool restart_pending = false;
+  int restarts_in_window = 0;
+  gint64 restart_window_start = 0;
+  std::atomic<gint64> outage_start = 0;
+  // Connection setup time, from the pipeline creation to ICE connected
+  std::atomic<gint64> setup_start = 0;
+
+  // Websocket viewers can come back with this token after their websocket
+  // dropped: until the grace period ends, their peer connection is kept
+  // and only ICE is restarted.
+  std::string session_token;
+  guint grace_timeout = 0;
+  std::atomic<gint64> resume_start = 0;
+
+  // One offer out at a time: tracks added or removed meanwhile are
+  // negotiated once the answer is in. Offers come from webrtcbin threads.
+  std::mutex negotiation_lock;
+  bool offer_pending = false;
+  bool renegotiate = false;
+  // The track listing this viewer last got
+  std::string tracks_sent;
+
+  // Capture to playout, as the viewer measures it, over
+  // Streamer::latency_bounds_ms
+  std::array<uint64_t, 11> latency_histogram{};
+  double latency_ms_last = -1.;
+
+  std::mutex jitterbuffers_lock;
+  std::vector<jitterbuffer_state> jitterbuffers;
   uint32_t sourceid = 0;
-  uint64_t num_samples = 0;
-  uint64_t num_frames = 0;
 
-  int64_t audio_feed{};
-  int64_t video_feed{};
+  // WHEP sessions have no websocket: the answer goes back on the paused
+  // HTTP request, and the session is then addressed by its resource id.
+  SoupMessage* whep_message = nullptr;
+  std::string whep_id;
+
+  // Indexed by source_kind
+  header_extension_ids extension_ids[2];
 
   boost::circular_buffer<audio_frame> buf = boost::circular_buffer<audio_frame>(128 * CHUNK_SIZE);
   audio_frame next_frame() noexcept;
 
-  bool push_data_audio(audio_buffer buf);
-  bool push_data_video(video_buffer buf);
+  bool push_data_audio(
+      track_input& track,
+      const unsigned char* data,
+      int frames,
+      uint64_t seq,
+      int64_t capture_us);
+  bool push_data_video(track_input& track, video_buffer buf);
 };
 
-//// Audio
+//// Thread topology
+
+// Applies CPU affinity and scheduling to the calling thread. Threads
+// inherit both from their creator, which is how the settings reach the
+// threads spawned by libraries we do not control (x264, libnice).
+// Settings are applied in full, as pooled streaming threads get reused for
+// other roles: no CPU means any CPU.
+static void apply_thread_settings(const thread_settings& t)
+{
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (t.cpus.empty())
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, &set);
+  for (int cpu : t.cpus)
+    CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    g_warning("Could not set the thread CPU affinity");
+
+  if (t.fifo_priority > 0)
+  {
+    sched_param param{.sched_priority = t.fifo_priority};
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+      g_warning("Could not set SCHED_FIFO priority %d", t.fifo_priority);
+  }
+  else
+  {
+    sched_param param{};
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    if (setpriority(PRIO_PROCESS, gettid(), t.nice) != 0)
+      g_warning("Could not set nice level %d", t.nice);
+  }
+#endif
+}
 
+// Viewer threads are named wb<viewer>:<name>, within the 15 characters
+// Linux keeps. Threads inherit the name of their creator, x264's included.
+static int thread_viewer(const char* name, const char** rest = nullptr)
+{
+  int viewer = 0, length = 0;
+  if (sscanf(name, "wb%d%n", &viewer, &length) != 1 || name[length] != ':')
+    return 0;
+  if (rest)
+    *rest = name + length + 1;
+  return viewer;
+}
 
-struct Streamer
+static void name_viewer_thread(int viewer)
 {
-  config conf;
+#if defined(__linux__)
+  char name[16]{};
+  prctl(PR_GET_NAME, name);
+  const char* rest = name;
+  thread_viewer(name, &rest);
+  char prefixed[16];
+  snprintf(prefixed, sizeof(prefixed), "wb%d:%s", viewer, rest);
+  prctl(PR_SET_NAME, prefixed);
+#endif
+}
+
+// Runs a scope with other thread settings, e.g. to create elements whose
+// internal threads should inherit them, then restores the current ones.
+struct scoped_thread_settings
+{
+#if defined(__linux__)
+  explicit scoped_thread_settings(const thread_settings& t)
+  {
+    pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    nice = getpriority(PRIO_PROCESS, gettid());
+    apply_thread_settings(t);
+  }
 
-  static bool push_data_audio(ReceiverEntry* data)
+  ~scoped_thread_settings()
   {
-    const gint num_samples = CHUNK_SIZE / 4;
-    GstBuffer* buffer = gst_buffer_new_and_alloc(CHUNK_SIZE);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    pthread_setschedparam(pthread_self(), policy, &param);
+    if (policy == SCHED_OTHER)
+      setpriority(PRIO_PROCESS, gettid(), nice);
+  }
 
-    GST_BUFFER_TIMESTAMP(buffer)
-        = gst_util_uint64_scale(data->num_samples, GST_SECOND, data->self->conf.rate);
-    GST_BUFFER_DURATION(buffer)
-        = gst_util_uint64_scale(num_samples, GST_SECOND, data->self->conf.rate);
+  cpu_set_t cpus;
+  int policy{};
+  sched_param param{};
+  int nice{};
+#else
+  explicit scoped_thread_settings(const thread_settings& t) { }
+#endif
+};
 
-    GstMapInfo map{};
+static std::string x264_threading(const config& conf)
+{
+  return " threads=" + std::to_string(conf.x264_threads)
+         + " sliced-threads=" + (conf.x264_sliced_threads ? "true " : "false ");
+}
 
-    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+//// Sources
 
-    auto raw = (float*)map.data;
+// Hands out one fixed block, for the control block of a shared_ptr: the
+// handles of the sources are created and released on the host threads.
+template <typename T>
+struct slot_allocator
+{
+  using value_type = T;
 
-    for (int i = 0; i < num_samples; i++)
-    {
-      auto frame = data->next_frame();
-      raw[i] = frame.sample[0];
-    }
-    data->num_samples += num_samples;
+  explicit slot_allocator(unsigned char* block, std::size_t size) noexcept
+      : block{block}
+      , size{size}
+  {
+  }
+  template <typename U>
+  slot_allocator(const slot_allocator<U>& other) noexcept
+      : block{other.block}
+      , size{other.size}
+  {
+  }
 
-    gst_buffer_unmap(buffer, &map);
+  T* allocate(std::size_t n)
+  {
+    if (n * sizeof(T) > size)
+      throw std::bad_alloc{};
+    return (T*)block;
+  }
+  void deallocate(T*, std::size_t) noexcept { }
+
+  template <typename U>
+  bool operator==(const slot_allocator<U>& other) const noexcept
+  {
+    return block == other.block;
+  }
 
-    GstFlowReturn ret{};
-    g_signal_emit_by_name(data->sound_in, "push-buffer", buffer, &ret);
-    gst_buffer_unref(buffer);
+  unsigned char* block;
+  std::size_t size;
+};
 
-    return ret == GST_FLOW_OK;
+// One producer feeding the Streamer, i.e. one avendish node. Each has its
+// own SPSC queues so that nodes running on different host threads never
+// share one. Sources live in preallocated slots which are recycled.
+struct Source
+{
+  enum state_t
+  {
+    free_slot,
+    claimed,
+    active,
+    closing
+  };
+
+  Streamer* streamer{};
+  int index{};
+  source_kind kind{};
+  std::string name;
+  uint32_t generation = 0;
+  int channels = 1;
+  sample_format format{};
+  std::atomic_int state{free_slot};
+  // Host side, out of process: where the media goes instead of the queues
+  shm_source* shm{};
+
+  // Blocks go to the main loop and come back once sent, out of a pool
+  // allocated with the slot: the host thread never allocates.
+  static constexpr int audio_pool_blocks = 64;
+  rigtorp::SPSCQueue<audio_buffer> audio_to_send{audio_pool_blocks};
+  rigtorp::SPSCQueue<audio_buffer> audio_to_free{audio_pool_blocks};
+  std::vector<unsigned char> audio_pool;
+  int audio_block_frames{};
+  // Producer side: blocks of the pool never handed out yet
+  int audio_pool_fresh{};
+
+  void allocate_audio_pool(int block_frames)
+  {
+    audio_block_frames = block_frames;
+    audio_pool.resize(std::size_t(audio_pool_blocks) * block_frames * 2 * sizeof(float));
   }
 
+  // Control blocks of the handles register_source returns, alternately: the
+  // last one may still be on its way out when the slot is reused.
+  alignas(std::max_align_t) unsigned char handle_blocks[2][128];
+  int handle_next{};
 
-  static void start_feed_audio(GstElement* source, guint size, ReceiverEntry* data)
+  // Producer side: a returned block, else a fresh one, else none left
+  void* take_audio_block() noexcept
   {
-    data->audio_feed++;
-    /*
-    if (data->sourceid == 0)
+    if (auto p = audio_to_free.front())
     {
-      g_print("Start feeding\n");
-      data->sourceid = g_idle_add((GSourceFunc)push_data_audio, data);
-    }*/
+      void* data = p->data;
+      audio_to_free.pop();
+      return data;
+    }
+    if (audio_pool_fresh == audio_pool_blocks)
+      return nullptr;
+    const std::size_t block_bytes = std::size_t(audio_block_frames) * 2 * sizeof(float);
+    return audio_pool.data() + block_bytes * audio_pool_fresh++;
   }
+  // Main loop side: audio not making a whole encoder frame yet, and the
+  // blocks it came in. Allocated with the slot, as the pool.
+  audio_ring pending;
+  boost::circular_buffer<pending_block> pending_blocks;
+  std::vector<unsigned char> chunk_scratch;
 
-  static void stop_feed_audio(GstElement* source, ReceiverEntry* data)
-  {/*
-    if (data->sourceid != 0)
-    {
-      g_print("Stop feeding\n");
-      g_source_remove(data->sourceid);
-      data->sourceid = 0;
-    }*/
+  void allocate_pending(std::size_t ring_bytes, std::size_t chunk_bytes)
+  {
+    pending.data.resize(ring_bytes);
+    pending_blocks.set_capacity(64);
+    chunk_scratch.resize(chunk_bytes);
   }
 
-  static void start_feed_video(GstElement* source, guint size, ReceiverEntry* data)
+  // Only the newest frame matters for live video: the node overwrites it,
+  // the main loop reads the latest one. Three frames at most per source.
+  triple_buffer<video_frame> video;
+  uint64_t video_last_seq{};
+  std::atomic<uint64_t> video_frames_skipped{};
+
+  // How far the host callbacks are from their nominal period, to see the
+  // effect of the thread topology under encoding load.
+  void measure_callback_jitter(int frames, int rate) noexcept
   {
-    data->video_feed++;
-    /*
-    if (data->sourceid == 0)
-    {
-      g_print("Start feeding\n");
-      data->sourceid = g_idle_add((GSourceFunc)push_data_audio, data);
-    }*/
+    const int64_t now = g_get_monotonic_time();
+    const int64_t last = std::exchange(last_callback_us, now);
+    if (last == 0 || rate <= 1)
+      return;
+
+    const int64_t period = int64_t(frames) * G_USEC_PER_SEC / rate;
+    const int64_t jitter = std::abs((now - last) - period);
+    callback_jitter_us_mean = 0.99 * callback_jitter_us_mean + 0.01 * jitter;
+    if (jitter > callback_jitter_us_max)
+      callback_jitter_us_max = jitter;
   }
 
-  static void stop_feed_video(GstElement* source, ReceiverEntry* data)
-  {/*
-    if (data->sourceid != 0)
-    {
-      g_print("Stop feeding\n");
-      g_source_remove(data->sourceid);
-      data->sourceid = 0;
-    }*/
+  // Producer side, numbers the blocks and frames for tracing
+  uint64_t sequence{};
+
+  int64_t last_callback_us{};
+  std::atomic<double> callback_jitter_us_mean{};
+  std::atomic<int64_t> callback_jitter_us_max{};
+
+  // Main loop side: how long blocks wait to be handed to the encoders
+  void measure_queue_wait(int64_t wait_us) noexcept
+  {
+    queue_wait_us_mean = 0.99 * queue_wait_us_mean + 0.01 * wait_us;
+    if (wait_us > queue_wait_us_max)
+      queue_wait_us_max = wait_us;
+  }
+  std::atomic<double> queue_wait_us_mean{};
+  std::atomic<int64_t> queue_wait_us_max{};
+
+  // Main loop side, once the producer is gone
+  void release()
+  {
+    while (audio_to_send.front())
+      audio_to_send.pop();
+    while (audio_to_free.front())
+      audio_to_free.pop();
+    audio_pool_fresh = 0;
+    pending.clear();
+    pending_blocks.clear();
+    // A frame published last must not reach the next source in this slot
+    video.update();
+    video_last_seq = 0;
+    video_frames_skipped = 0;
+    sequence = 0;
+    last_callback_us = 0;
+    callback_jitter_us_mean = 0.;
+    callback_jitter_us_max = 0;
+    queue_wait_us_mean = 0.;
+    queue_wait_us_max = 0;
+    state = free_slot;
+  }
+};
+
+static_assert(int(Source::free_slot) == shm_free && int(Source::claimed) == shm_claimed
+              && int(Source::active) == shm_active && int(Source::closing) == shm_closing);
+
+//// Audio
+
+
+struct Streamer
+{
+  config conf;
+
+  static void start_feed_cb(
+      G_GNUC_UNUSED GstElement* appsrc, G_GNUC_UNUSED guint size, track_input* track)
+  {
+    track->feed++;
   }
 
+  // Errors only ever take down the pipeline they happened in: the
+  // receiver is rebuilt from the main loop, the others keep streaming.
   static gboolean
   bus_watch_cb(GstBus* bus, GstMessage* message, gpointer user_data)
   {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+
     switch (GST_MESSAGE_TYPE(message))
     {
     case GST_MESSAGE_ERROR:
@@ -188,10 +879,21 @@ struct Streamer
       gchar* debug = nullptr;
 
       gst_message_parse_error(message, &error, &debug);
-      g_error("Error on bus: %s (debug: %s)", error->message, debug);
-      exit(1);
+      g_warning("Error on bus: %s (debug: %s)", error->message, debug);
       g_error_free(error);
       g_free(debug);
+
+      Streamer& self = *receiver_entry->self;
+      self.stats.errors++;
+      // Only the first error of a pipeline triggers a restart
+      if (!receiver_entry->restart_pending)
+      {
+        receiver_entry->restart_pending = true;
+        gint64 no_outage = 0;
+        receiver_entry->outage_start.compare_exchange_strong(
+              no_outage, g_get_monotonic_time());
+        g_idle_add(restart_receiver_cb, new receiver_ref{&self, receiver_entry});
+      }
       break;
     }
     case GST_MESSAGE_WARNING:
@@ -212,10 +914,42 @@ struct Streamer
     return G_SOURCE_CONTINUE;
   }
 
-  static GstWebRTCPriorityType _priority_from_string(const gchar* s)
+  // STREAM_STATUS enter is posted synchronously from the new streaming
+  // thread itself. The source threads do the scaling and conversion and the
+  // encoder queue thread is the one creating x264's threads: these get the
+  // encoder settings, all the others the network ones. In viewer pipelines
+  // they are all named after the viewer.
+  static GstBusSyncReply
+  bus_sync_cb(GstBus* bus, GstMessage* message, gpointer user_data)
   {
-    return GST_WEBRTC_PRIORITY_TYPE_MEDIUM;
+    if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS)
+      return GST_BUS_PASS;
+
+    GstStreamStatusType type{};
+    GstElement* owner{};
+    gst_message_parse_stream_status(message, &type, &owner);
+    if (type != GST_STREAM_STATUS_TYPE_ENTER || !owner)
+      return GST_BUS_PASS;
+
+    if (const int viewer = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(bus), "viewer")))
+      name_viewer_thread(viewer);
+
+    Streamer& self = *(Streamer*)user_data;
+    if (!self.conf.encoder_threads.enabled() && !self.conf.network_threads.enabled())
+      return GST_BUS_PASS;
+
+    const gchar* name = GST_ELEMENT_NAME(owner);
+    if (g_str_has_prefix(name, "encqueue") || g_str_has_prefix(name, "myvid")
+        || g_str_has_prefix(name, "mysound"))
+      apply_thread_settings(self.conf.encoder_threads);
+    else
+      apply_thread_settings(self.conf.network_threads);
 
+    return GST_BUS_PASS;
+  }
+
+  static GstWebRTCPriorityType _priority_from_string(const gchar* s)
+  {
     GEnumClass* klass
         = (GEnumClass*)g_type_class_ref(GST_TYPE_WEBRTC_PRIORITY_TYPE);
     GEnumValue* en;
@@ -230,542 +964,4163 @@ struct Streamer
 
     return GstWebRTCPriorityType{};
   }
-  static std::shared_ptr<ReceiverEntry>
-  create_receiver_entry(SoupWebsocketConnection* connection, Streamer& self)
-  {
-    auto receiver_entry = std::make_shared<ReceiverEntry>();
-    receiver_entry->self = &self;
-    receiver_entry->connection = connection;
+  //// Tracks
 
-    g_object_ref(G_OBJECT(connection));
+  static const char* kind_name(source_kind kind)
+  {
+    return kind == source_kind::audio ? "audio" : "video";
+  }
 
-    g_signal_connect(
-          G_OBJECT(connection),
-          "message",
-          G_CALLBACK(soup_websocket_message_cb),
-          (gpointer)receiver_entry.get());
+  // Slots of the active sources a viewer subscribed to, in slot order
+  std::vector<int> select_tracks(const std::vector<std::string>& subscription) const
+  {
+    std::vector<int> selected;
+    for (int i = 0; i < int(sources.size()); i++)
+    {
+      const auto& src = *sources[i];
+      if (src.state.load(std::memory_order_acquire) != Source::active)
+        continue;
+      if (subscription.empty()
+          || std::find(subscription.begin(), subscription.end(), src.name)
+                 != subscription.end())
+        selected.push_back(i);
+    }
+    return selected;
+  }
 
-    GError* error = nullptr;
-    std::string pipeline_web
-        = "webrtcbin latency=1 name=webrtcbin stun-server=stun://" STUN_SERVER;
-    std::string pipeline_video
-        = "   appsrc is-live=1 name=myvid leaky-type=2 min-latency=0  "
-          " ! videorate "
-          " ! videoscale "
-          " ! video/x-raw,width=1280,height=720,framerate=60/1 "
-          " ! videoconvert "
-          " ! queue max-size-buffers=1 "
-          " ! x264enc bitrate=2400 speed-preset=medium tune=zerolatency key-int-max=15 "
-          " ! video/x-h264,profile=constrained-baseline "
-          " ! queue max-size-time=100 "
-          " ! h264parse "
-          " ! rtph264pay config-interval=-1 name=payloader aggregate-mode=zero-latency "
-          " ! application/x-rtp,media=video,encoding-name=H264,payload=96 "
-          " ! webrtcbin. ";
-
-    std::string pipeline_audio
-        = " appsrc is-live=1 name=mysound leaky-type=2 min-latency=0 ! "
-          "audioconvert ! audioresample ! "
-          "opusenc audio-type=restricted-lowdelay bandwidth=fullband bitrate=128000 frame-size=2.5 ! "
-          "rtpopuspay pt=97 ! webrtcbin. ";
-
-    receiver_entry->pipeline = gst_parse_launch(
-                                 (pipeline_web + pipeline_video + pipeline_audio).c_str(), &error);
-    if (error != nullptr)
+  JsonArray* tracks_to_json() const
+  {
+    JsonArray* array = json_array_new();
+    for (int i : select_tracks({}))
     {
-      g_error("Could not create WebRTC pipeline: %s\n", error->message);
-      g_error_free(error);
-      return {};
+      JsonObject* track = json_object_new();
+      json_object_set_string_member(track, "name", sources[i]->name.c_str());
+      json_object_set_string_member(track, "kind", kind_name(sources[i]->kind));
+      json_array_add_object_element(array, track);
     }
+    return array;
+  }
+
+  std::string tracks_message() const
+  {
+    JsonObject* msg = json_object_new();
+    json_object_set_string_member(msg, "type", "tracks");
+    JsonObject* data = json_object_new();
+    json_object_set_array_member(data, "tracks", tracks_to_json());
+    json_object_set_object_member(msg, "data", data);
+
+    gchar* json_string = get_string_from_json_object(msg);
+    json_object_unref(msg);
+    std::string message = json_string;
+    g_free(json_string);
+    return message;
+  }
+
+  // Only when it lists other tracks than the last one the viewer got
+  void send_tracks(ReceiverEntry& receiver_entry, std::string message) const
+  {
+    if (!receiver_entry.connection || message == receiver_entry.tracks_sent)
+      return;
+    soup_websocket_connection_send_text(receiver_entry.connection, message.c_str());
+    receiver_entry.tracks_sent = std::move(message);
+  }
+
+  static std::string scaled_caps(rendition quality)
+  {
+    return quality == rendition::low ? "video/x-raw,width=640,height=360,framerate=60/1"
+                                     : "video/x-raw,width=1280,height=720,framerate=60/1";
+  }
+
+  // Raw input of a track up to its encoder, element names suffixed by the
+  // source slot. The encoder queue thread is the one spawning x264's.
+  static std::string
+  video_encoder(const Streamer& self, int id, rendition quality = rendition::full)
+  {
+    const auto n = std::to_string(id);
+    return "   appsrc is-live=1 name=myvid_" + n + " leaky-type=2 min-latency=0  "
+           " ! videorate "
+           " ! videoscale "
+           " ! capsfilter name=scale_" + n + " caps=\"" + scaled_caps(quality) + "\" "
+           " ! videoconvert "
+           " ! queue name=encqueue_" + n + " max-size-buffers=1 "
+           " ! x264enc name=enc_" + n + " bitrate=" + std::to_string(video_kbps(quality))
+         + " speed-preset=medium tune=zerolatency key-int-max=15 "
+         + x264_threading(self.conf) +
+           " ! video/x-h264,profile=constrained-baseline ";
+  }
+
+  // Everything a track needs up to webrtcbin
+  static std::string track_branch(const Streamer& self, int source, rendition quality)
+  {
+    const auto id = std::to_string(source);
+    if (self.sources[source]->kind == source_kind::video)
+      return video_encoder(self, source, quality)
+             + " ! queue max-size-time=100 "
+               " ! h264parse ! " + encoded_tee(source)
+             + " ! rtph264pay config-interval=-1 name=payloader_" + id
+             + " aggregate-mode=zero-latency "
+               " ! application/x-rtp,media=video,encoding-name=H264,payload=96 "
+               " ! capsfilter name=rtpcaps_" + id
+             + (self.conf.pacing_factor > 0.
+                    ? " ! identity ! queue name=pacer_" + id
+                          + " max-size-buffers=1000 max-size-bytes=0 max-size-time=0 "
+                    : "");
+    else
+      return audio_encoder(source, self.conf.opus_frame_ms) + encoded_tee(source)
+             + " ! rtpopuspay name=payloader_" + id + " pt=97 ! capsfilter name=rtpcaps_" + id;
+  }
+
+  // Where the fMP4 muxer can take the encoded track from, see
+  // Streamer::update_fmp4_input
+  static std::string encoded_tee(int source)
+  {
+    return "tee name=encoded_" + std::to_string(source) + " allow-not-linked=true ";
+  }
+
+  static std::string audio_encoder(int id, double frame_ms)
+  {
+    char frame_size[16];
+    snprintf(frame_size, sizeof(frame_size), "%g", frame_ms);
+    return " appsrc is-live=1 name=mysound_" + std::to_string(id)
+           + " leaky-type=2 min-latency=0 ! "
+             "audioconvert ! audioresample ! "
+             "opusenc name=enc_" + std::to_string(id)
+           + " audio-type=restricted-lowdelay bandwidth=fullband bitrate=128000 frame-size="
+           + frame_size + " ! ";
+  }
+
+  static void setup_sources(ReceiverEntry& receiver_entry, Streamer& self)
+  {
+    for (auto& track : receiver_entry.tracks)
+      setup_track(receiver_entry, self, *track);
+  }
 
-    // Setup the sound source
+  // Caps, buffer pool and feed of the appsrc of a track
+  static void setup_track(ReceiverEntry& receiver_entry, Streamer& self, track_input& track)
+  {
+    const auto id = std::to_string(track.source);
+    if (track.kind == source_kind::audio)
     {
-      receiver_entry->sound_in
-          = gst_bin_get_by_name(GST_BIN(receiver_entry->pipeline), "mysound");
-      g_assert(receiver_entry->sound_in);
+      track.appsrc = gst_bin_get_by_name(
+            GST_BIN(receiver_entry.pipeline), ("mysound_" + id).c_str());
+      g_assert(track.appsrc);
 
+      const auto& src = *self.sources[track.source];
       GstAudioInfo info;
       gst_audio_info_set_format(
-            &info, GST_AUDIO_FORMAT_F32, self.conf.rate, 1, nullptr);
-      GstCaps* audio_caps;
-      audio_caps = gst_audio_info_to_caps(&info);
-      g_object_set(
-            receiver_entry->sound_in,
-            "caps",
-            audio_caps,
-            "format",
-            GST_FORMAT_TIME,
+            &info,
+            src.format == sample_format::s16 ? GST_AUDIO_FORMAT_S16 : GST_AUDIO_FORMAT_F32,
+            self.conf.rate,
+            src.channels,
             nullptr);
-      g_signal_connect(
-            receiver_entry->sound_in,
-            "need-data",
-            G_CALLBACK(start_feed_audio),
-            receiver_entry.get());
-      g_signal_connect(
-            receiver_entry->sound_in,
-            "enough-data",
-            G_CALLBACK(stop_feed_audio),
-            receiver_entry.get());
+      GstCaps* audio_caps = gst_audio_info_to_caps(&info);
+      g_object_set(
+            track.appsrc, "caps", audio_caps, "format", GST_FORMAT_TIME, nullptr);
 
-      // for(int i = 0; i < 16; i++) {
-      //   push_data_audio(receiver_entry);
-      // }
+      track.pool = gst_buffer_pool_new();
+      GstStructure* pool_config = gst_buffer_pool_get_config(track.pool);
+      gst_buffer_pool_config_set_params(
+            pool_config,
+            audio_caps,
+            self.audio_chunk_frames() * src.channels * sample_size(src.format),
+            4,
+            0);
+      gst_buffer_pool_set_config(track.pool, pool_config);
+      gst_buffer_pool_set_active(track.pool, TRUE);
+      gst_caps_unref(audio_caps);
     }
-
-    // Setup the video source
+    else
     {
-      receiver_entry->video_in
-          = gst_bin_get_by_name(GST_BIN(receiver_entry->pipeline), "myvid");
+      track.appsrc = gst_bin_get_by_name(
+            GST_BIN(receiver_entry.pipeline), ("myvid_" + id).c_str());
+      g_assert(track.appsrc);
+
       GstVideoInfo info;
       gst_video_info_set_format(&info, GST_VIDEO_FORMAT_RGBA, 1280, 720);
       GstCaps* video_caps = gst_video_info_to_caps(&info);
-
       g_object_set(
-          receiver_entry->video_in,
-          "caps",
-          video_caps,
-          "format",
-          GST_FORMAT_TIME,
-          nullptr);
+            track.appsrc, "caps", video_caps, "format", GST_FORMAT_TIME, nullptr);
+      gst_caps_unref(video_caps);
+    }
 
-      g_signal_connect(
-          receiver_entry->video_in,
-          "need-data",
-          G_CALLBACK(start_feed_video),
-          receiver_entry.get());
+    g_signal_connect(
+          track.appsrc, "need-data", G_CALLBACK(start_feed_cb), &track);
+    setup_header_extensions(receiver_entry, self, track);
+    if (track.kind == source_kind::video)
+      setup_pacer(receiver_entry, self, track);
+
+#if defined(WITCHBRIDGE_TRACING)
+    if (tracer.enabled)
+      add_trace_probes(receiver_entry, track);
+#endif
+  }
 
-      g_signal_connect(
-          receiver_entry->video_in,
-          "enough-data",
-          G_CALLBACK(stop_feed_video),
-          receiver_entry.get());
+  //// RTP header extensions
+
+  // Playout delay: 12 bits each for the minimum and maximum, in 10 ms
+  // units. Absolute capture time: NTP time of the capture, on the first
+  // packet of each frame, that is the first with a new RTP timestamp.
+  static constexpr const char* playout_delay_uri
+      = "http://www.webrtc.org/experiments/rtp-hdrext/playout-delay";
+  static constexpr const char* capture_time_uri
+      = "http://www.webrtc.org/experiments/rtp-hdrext/abs-capture-time";
+
+  struct header_extensions
+  {
+    track_input* track;
+    const header_extension_ids* ids;
+    bool playout_delay;
+    guint8 playout_delay_data[3];
+    bool capture_time;
+    // Only touched from the payloader streaming thread
+    bool have_rtp_time;
+    guint32 last_rtp_time;
+  };
+
+  const playout_delay& playout_for(int source) const
+  {
+    auto it = conf.track_playout.find(sources[source]->name);
+    return it != conf.track_playout.end() ? it->second : conf.playout;
+  }
+
+  // Payloaders push each frame's packets together, all with its timestamp
+  static bool starts_frame(GstBuffer* buffer, header_extensions& ext)
+  {
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+      return false;
+    const guint32 rtp_time = gst_rtp_buffer_get_timestamp(&rtp);
+    gst_rtp_buffer_unmap(&rtp);
+
+    const bool first = !ext.have_rtp_time || rtp_time != ext.last_rtp_time;
+    ext.have_rtp_time = true;
+    ext.last_rtp_time = rtp_time;
+    return first;
+  }
 
+  static void write_header_extensions(GstBuffer** buffer, header_extensions& ext)
+  {
+    const int playout_delay_id
+        = ext.playout_delay ? ext.ids->playout_delay.load(std::memory_order_relaxed) : 0;
+    const int capture_time_id
+        = ext.capture_time ? ext.ids->capture_time.load(std::memory_order_relaxed) : 0;
+
+    int64_t capture_us = -1;
+    if (capture_time_id && starts_frame(*buffer, ext))
+    {
+      if (auto meta = gst_buffer_get_reference_timestamp_meta(*buffer, unix_time_caps()))
+        capture_us = meta->timestamp / 1000;
+      else if (GST_BUFFER_PTS_IS_VALID(*buffer))
+        if (auto frame = ext.track->find_recent(GST_BUFFER_PTS(*buffer)))
+          capture_us = frame->capture_us;
+    }
+    if (!playout_delay_id && capture_us < 0)
+      return;
+
+    *buffer = gst_buffer_make_writable(*buffer);
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(*buffer, GST_MAP_READWRITE, &rtp))
+      return;
+
+    if (playout_delay_id)
+      gst_rtp_buffer_add_extension_onebyte_header(
+            &rtp, playout_delay_id, ext.playout_delay_data, 3);
+    if (capture_us >= 0)
+    {
+      const uint64_t seconds = capture_us / G_USEC_PER_SEC + 2208988800ull;
+      const uint64_t fraction = ((capture_us % G_USEC_PER_SEC) << 32) / G_USEC_PER_SEC;
+      const uint64_t ntp = GUINT64_TO_BE((seconds << 32) | fraction);
+      gst_rtp_buffer_add_extension_onebyte_header(&rtp, capture_time_id, &ntp, 8);
     }
+    gst_rtp_buffer_unmap(&rtp);
+  }
 
+  // Payloaders push lists of packets when they fragment a frame
+  static GstPadProbeReturn
+  header_extensions_probe_cb(G_GNUC_UNUSED GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+  {
+    auto& ext = *(header_extensions*)user_data;
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+    {
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      write_header_extensions(&buffer, ext);
+      GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    }
+    else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
     {
-      receiver_entry->webrtcbin
-          = gst_bin_get_by_name(GST_BIN(receiver_entry->pipeline), "webrtcbin");
-      g_assert(receiver_entry->webrtcbin != nullptr);
+      GstBufferList* list
+          = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+      gst_buffer_list_foreach(
+            list,
+            [](GstBuffer** buffer, G_GNUC_UNUSED guint idx, gpointer ext) {
+              write_header_extensions(buffer, *(header_extensions*)ext);
+              return TRUE;
+            },
+            user_data);
+      GST_PAD_PROBE_INFO_DATA(info) = list;
+    }
+    return GST_PAD_PROBE_OK;
+  }
 
-      // Setup the webrtc internal latency
+  // Announced in the caps after the payloader, which webrtcbin turns into
+  // extmaps, and written by a probe on the payloader. Only those the viewer
+  // has not turned down: for WHEP viewers, those of the offer, with its ids.
+  static void
+  setup_header_extensions(ReceiverEntry& receiver_entry, const Streamer& self, track_input& track)
+  {
+    const auto& ids = receiver_entry.extension_ids[int(track.kind)];
+    const auto& delay = self.playout_for(track.source);
+    const int playout_delay_id = delay.enabled() ? ids.playout_delay.load() : 0;
+    const int capture_time_id = self.conf.capture_time ? ids.capture_time.load() : 0;
+    if (!playout_delay_id && !capture_time_id)
+      return;
+
+    const auto id = std::to_string(track.source);
+    auto bin = GST_BIN(receiver_entry.pipeline);
+    GstElement* caps_filter = gst_bin_get_by_name(bin, ("rtpcaps_" + id).c_str());
+    GstElement* payloader = gst_bin_get_by_name(bin, ("payloader_" + id).c_str());
+    if (caps_filter && payloader)
+    {
+      auto ext = new header_extensions{.track = &track, .ids = &ids};
+      GstCaps* caps = gst_caps_new_empty_simple("application/x-rtp");
+      if (playout_delay_id)
       {
-        auto rtpbin = gst_bin_get_by_name(GST_BIN(receiver_entry->webrtcbin), "rtpbin");
-        g_assert_nonnull (rtpbin);
-        g_object_set(rtpbin, "latency", 10, nullptr);
-        // g_object_set(rtpbin, "sync", false, nullptr);
-        // g_object_set(rtpbin, "async", false, nullptr);
-        g_object_unref(rtpbin);
+        const int min = std::min(delay.min_ms / 10, 0xfff);
+        const int max = std::min(delay.max_ms / 10, 0xfff);
+        ext->playout_delay = true;
+        ext->playout_delay_data[0] = guint8(min >> 4);
+        ext->playout_delay_data[1] = guint8(((min & 0xf) << 4) | (max >> 8));
+        ext->playout_delay_data[2] = guint8(max & 0xff);
+        gst_caps_set_simple(
+              caps,
+              ("extmap-" + std::to_string(playout_delay_id)).c_str(),
+              G_TYPE_STRING,
+              playout_delay_uri,
+              nullptr);
       }
-
-      // Setup transceivers
-      GArray* transceivers{};
-      g_signal_emit_by_name(
-            receiver_entry->webrtcbin, "get-transceivers", &transceivers);
-      g_assert(transceivers != nullptr && transceivers->len > 1);
-      auto trans = g_array_index(transceivers, GstWebRTCRTPTransceiver*, 0);
-      g_object_set(
-            trans,
-            "direction",
-            GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY,
-            nullptr);
-      if (video_priority)
+      if (capture_time_id)
       {
-        GstWebRTCPriorityType priority;
+        ext->capture_time = true;
+        gst_caps_set_simple(
+              caps,
+              ("extmap-" + std::to_string(capture_time_id)).c_str(),
+              G_TYPE_STRING,
+              capture_time_uri,
+              nullptr);
+      }
+      g_object_set(caps_filter, "caps", caps, nullptr);
+      gst_caps_unref(caps);
+
+      GstPad* src = gst_element_get_static_pad(payloader, "src");
+      gst_pad_add_probe(
+            src,
+            GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+            header_extensions_probe_cb,
+            ext,
+            [](gpointer p) { delete (header_extensions*)p; });
+      gst_object_unref(src);
+    }
+    if (caps_filter)
+      gst_object_unref(caps_filter);
+    if (payloader)
+      gst_object_unref(payloader);
+  }
 
-        priority = _priority_from_string(video_priority);
-        if (priority)
-        {
-          GstWebRTCRTPSender* sender;
+  // An a=extmap line is "<id>[/<direction>] <uri> [<attributes>]". Only
+  // ids that fit the one-byte header the probes write count.
+  static int extmap_id(const GstSDPAttribute* attribute, const char* uri)
+  {
+    int id = 0, length = 0;
+    if (g_strcmp0(attribute->key, "extmap") != 0 || !attribute->value
+        || sscanf(attribute->value, "%d%n", &id, &length) != 1)
+      return 0;
+    const char* rest = strchr(attribute->value + length, ' ');
+    if (!rest)
+      return 0;
+    rest += strspn(rest, " ");
+    const std::size_t n = strlen(uri);
+    if (strncmp(rest, uri, n) != 0 || (rest[n] != '\0' && rest[n] != ' '))
+      return 0;
+    return id >= 1 && id <= 14 ? id : 0;
+  }
 
-          g_object_get(trans, "sender", &sender, nullptr);
-          gst_webrtc_rtp_sender_set_priority(sender, priority);
-          g_object_unref(sender);
-        }
+  // The id the SDP maps an extension to for a kind of media, 0 if none
+  static int sdp_extmap_id(const GstSDPMessage* sdp, source_kind kind, const char* uri)
+  {
+    const char* media_name = kind == source_kind::audio ? "audio" : "video";
+    for (guint m = 0; m < gst_sdp_message_medias_len(sdp); m++)
+    {
+      const GstSDPMedia* media = gst_sdp_message_get_media(sdp, m);
+      if (g_strcmp0(gst_sdp_media_get_media(media), media_name) != 0)
+        continue;
+      for (guint a = 0; a < gst_sdp_media_attributes_len(media); a++)
+        if (int id = extmap_id(gst_sdp_media_get_attribute(media, a), uri))
+          return id;
+    }
+    for (guint a = 0; a < gst_sdp_message_attributes_len(sdp); a++)
+      if (int id = extmap_id(gst_sdp_message_get_attribute(sdp, a), uri))
+        return id;
+    return 0;
+  }
+
+  // From the viewer's offer (WHEP) or answer: ids it does not map are
+  // turned down, and no longer written
+  static void take_extension_ids(ReceiverEntry& receiver_entry, const GstSDPMessage* sdp)
+  {
+    for (source_kind kind : {source_kind::audio, source_kind::video})
+    {
+      auto& ids = receiver_entry.extension_ids[int(kind)];
+      ids.playout_delay = sdp_extmap_id(sdp, kind, playout_delay_uri);
+      ids.capture_time = sdp_extmap_id(sdp, kind, capture_time_uri);
+    }
+  }
+
+  static track_input* track_for_mid(ReceiverEntry& receiver_entry, const char* mid)
+  {
+    for (auto& track : receiver_entry.tracks)
+    {
+      if (!track->webrtc_pad || !mid)
+        continue;
+
+      GstWebRTCRTPTransceiver* trans = nullptr;
+      g_object_get(track->webrtc_pad, "transceiver", &trans, nullptr);
+      if (!trans)
+        continue;
+
+      gchar* track_mid = nullptr;
+      g_object_get(trans, "mid", &track_mid, nullptr);
+      gst_object_unref(trans);
+      const bool match = g_strcmp0(track_mid, mid) == 0;
+      g_free(track_mid);
+      if (match)
+        return track.get();
+    }
+    return nullptr;
+  }
+
+  static constexpr std::array<double, 10> latency_bounds_ms{
+      10., 20., 30., 50., 75., 100., 150., 200., 300., 500.};
+
+  // What the viewer's jitter buffers hold per track, from its getStats,
+  // and how long after their capture its frames play
+  static void apply_report(ReceiverEntry& receiver_entry, JsonArray* reports)
+  {
+    for (guint i = 0; i < json_array_get_length(reports); i++)
+    {
+      JsonObject* report = json_array_get_object_element(reports, i);
+      if (!report || !json_object_has_member(report, "mid"))
+        continue;
+
+      track_input* track
+          = track_for_mid(receiver_entry, json_object_get_string_member(report, "mid"));
+      if (track && json_object_has_member(report, "jitter_buffer_ms"))
+        track->jitter_buffer_ms = json_object_get_double_member(report, "jitter_buffer_ms");
+
+      if (json_object_has_member(report, "e2e_latency_ms"))
+      {
+        const double latency = json_object_get_double_member(report, "e2e_latency_ms");
+        const auto bucket = std::upper_bound(
+                              latency_bounds_ms.begin(), latency_bounds_ms.end(), latency)
+                            - latency_bounds_ms.begin();
+        receiver_entry.latency_histogram[bucket]++;
+        receiver_entry.latency_ms_last = latency;
       }
-      trans = g_array_index(transceivers, GstWebRTCRTPTransceiver*, 1);
-      g_object_set(
-            trans,
-            "direction",
-            GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY,
-            nullptr);
-      if (audio_priority)
+    }
+  }
+
+  JsonObject* latency_to_json() const
+  {
+    JsonObject* latency = json_object_new();
+    JsonArray* bounds = json_array_new();
+    for (double bound : latency_bounds_ms)
+      json_array_add_double_element(bounds, bound);
+    json_object_set_array_member(latency, "bounds_ms", bounds);
+
+    std::array<uint64_t, 11> total{};
+    JsonArray* viewers = json_array_new();
+    for (std::size_t i = 0; i < receivers.size(); i++)
+    {
+      const auto& receiver = *receivers[i];
+      if (receiver.latency_ms_last < 0.)
+        continue;
+
+      JsonArray* histogram = json_array_new();
+      for (std::size_t b = 0; b < total.size(); b++)
       {
-        GstWebRTCPriorityType priority;
+        json_array_add_int_element(histogram, receiver.latency_histogram[b]);
+        total[b] += receiver.latency_histogram[b];
+      }
+      JsonObject* viewer = json_object_new();
+      json_object_set_int_member(viewer, "viewer", i);
+      json_object_set_double_member(viewer, "last_ms", receiver.latency_ms_last);
+      json_object_set_array_member(viewer, "histogram", histogram);
+      json_array_add_object_element(viewers, viewer);
+    }
 
-        priority = _priority_from_string(audio_priority);
-        if (priority)
-        {
-          GstWebRTCRTPSender* sender;
+    JsonArray* histogram = json_array_new();
+    for (uint64_t count : total)
+      json_array_add_int_element(histogram, count);
+    json_object_set_array_member(latency, "histogram", histogram);
+    json_object_set_array_member(latency, "viewers", viewers);
+    return latency;
+  }
 
-          g_object_get(trans, "sender", &sender, nullptr);
-          gst_webrtc_rtp_sender_set_priority(sender, priority);
-          g_object_unref(sender);
+  // The configured delay next to what the viewers report
+  JsonArray* playout_to_json() const
+  {
+    JsonArray* array = json_array_new();
+    for (int source : select_tracks({}))
+    {
+      double sum = 0.;
+      int reports = 0;
+      for (auto& receiver : receivers)
+      {
+        for (auto& track : receiver->tracks)
+        {
+          if (track->source == source && track->generation == sources[source]->generation
+              && track->jitter_buffer_ms >= 0.)
+          {
+            sum += track->jitter_buffer_ms;
+            reports++;
+          }
         }
       }
-      g_array_unref(transceivers);
 
-      g_signal_connect(
-            receiver_entry->webrtcbin,
-            "on-negotiation-needed",
-            G_CALLBACK(on_negotiation_needed_cb),
-            (gpointer)receiver_entry.get());
+      const auto& delay = playout_for(source);
+      JsonObject* track = json_object_new();
+      json_object_set_string_member(track, "name", sources[source]->name.c_str());
+      json_object_set_int_member(track, "min_ms", delay.min_ms);
+      json_object_set_int_member(track, "max_ms", delay.max_ms);
+      json_object_set_int_member(track, "reports", reports);
+      json_object_set_double_member(
+            track, "jitter_buffer_ms", reports > 0 ? sum / reports : -1.);
+      json_array_add_object_element(array, track);
+    }
+    return array;
+  }
 
-      g_signal_connect(
-            receiver_entry->webrtcbin,
-            "on-ice-candidate",
-            G_CALLBACK(on_ice_candidate_cb),
-            (gpointer)receiver_entry.get());
+  //// Pacing
 
-      GstBus* bus;
-      bus = gst_pipeline_get_bus(GST_PIPELINE(receiver_entry->pipeline));
-      gst_bus_add_watch(bus, bus_watch_cb, nullptr);
-      gst_object_unref(bus);
+  // A keyframe leaves the payloader as a burst of packets, which
+  // constrained uplinks drop. The pacer queue thread spreads them at the
+  // viewer's bandwidth estimate, see update_pacing, waiting on the clock
+  // before each one. The identity before it splits the payloader's buffer
+  // lists, which the queue would otherwise keep whole.
+  static void setup_pacer(ReceiverEntry& receiver_entry, const Streamer& self, track_input& track)
+  {
+    const auto id = std::to_string(track.source);
+    auto bin = GST_BIN(receiver_entry.pipeline);
+    GstElement* payloader = gst_bin_get_by_name(bin, ("payloader_" + id).c_str());
+    GstElement* queue = gst_bin_get_by_name(bin, ("pacer_" + id).c_str());
+    auto& pacer = track.pacer;
+
+    // Measured even when not paced, for the comparison
+    if (payloader)
+    {
+      GstPad* src = gst_element_get_static_pad(payloader, "src");
+      gst_pad_add_probe(
+            src,
+            GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+            burst_probe_cb,
+            &pacer.before,
+            nullptr);
+      gst_object_unref(src);
+      gst_object_unref(payloader);
     }
 
-    if (gst_element_set_state(receiver_entry->pipeline, GST_STATE_PLAYING)
-        == GST_STATE_CHANGE_FAILURE)
-      g_error("Could not start pipeline");
+    if (queue)
+    {
+      pacer.bytes_per_us = pacing_rate(self, receiver_entry.quality);
+      pacer.max_delay_us = gint64(self.conf.pacer_max_delay_ms) * 1000;
+      pacer.queue = queue;
+      pacer.next_send = 0;
+
+      GstPad* src = gst_element_get_static_pad(queue, "src");
+      gst_pad_add_probe(
+            src,
+            GST_PAD_PROBE_TYPE_BUFFER,
+            pacer_probe_cb,
+            &pacer,
+            nullptr);
+      gst_object_unref(src);
+      gst_object_unref(queue);
+    }
+  }
 
-    return receiver_entry;
+  // The encoder bitrate, in bytes per microsecond: pacing below it only
+  // grows the queue until the maximum delay forgives the debt
+  static double encoder_rate(rendition quality)
+  {
+    return video_kbps(quality) * 1000. / 8. / G_USEC_PER_SEC;
   }
-  static void destroy_receiver_entry(gpointer receiver_entry_ptr)
+
+  // The ceiling of the pacing rate, which the bandwidth estimate moves
+  // under, see Streamer::update_pacing
+  static double pacing_rate(const Streamer& self, rendition quality)
   {
-    ReceiverEntry* receiver_entry = (ReceiverEntry*)receiver_entry_ptr;
+    return self.conf.pacing_factor * encoder_rate(quality);
+  }
 
-    g_assert(receiver_entry != nullptr);
+  static gsize probe_size(GstPadProbeInfo* info)
+  {
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+      return gst_buffer_list_calculate_size(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    return gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+  }
 
-    if (receiver_entry->pipeline != nullptr)
-    {
-      gst_element_set_state(
-            GST_ELEMENT(receiver_entry->pipeline), GST_STATE_NULL);
+  static GstPadProbeReturn
+  burst_probe_cb(G_GNUC_UNUSED GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+  {
+    ((burst_meter*)user_data)->add(g_get_monotonic_time(), probe_size(info));
+    return GST_PAD_PROBE_OK;
+  }
 
-      gst_object_unref(GST_OBJECT(receiver_entry->webrtcbin));
-      gst_object_unref(GST_OBJECT(receiver_entry->pipeline));
+  // Runs in the pacer queue thread, which does nothing else: waiting
+  // there holds back only the packets behind this one. The wait is
+  // bounded by the maximum delay, which also bounds teardown.
+  static GstPadProbeReturn
+  pacer_probe_cb(G_GNUC_UNUSED GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+  {
+    auto& pacer = *(video_pacer*)user_data;
+    GstClock* clock = gst_element_get_clock(pacer.queue);
+    if (!clock)
+      return GST_PAD_PROBE_OK;
+
+    const gsize size = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+    const double bytes_per_us = pacer.bytes_per_us.load(std::memory_order_relaxed);
+    const GstClockTime now = gst_clock_get_time(clock);
+    pacer.next_send = std::max(pacer.next_send, now);
+
+    // Further behind than the cap, the debt is forgiven: latency matters
+    // more than smoothness
+    const GstClockTime max_delay = pacer.max_delay_us * GST_USECOND;
+    if (pacer.next_send - now > max_delay)
+    {
+      pacer.next_send = now + max_delay;
+      pacer.overruns.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (pacer.next_send > now)
+    {
+      GstClockID id = gst_clock_new_single_shot_id(clock, pacer.next_send);
+      gst_clock_id_wait(id, nullptr);
+      gst_clock_id_unref(id);
     }
+    gst_object_unref(clock);
 
-    if (receiver_entry->connection != nullptr)
-      g_object_unref(G_OBJECT(receiver_entry->connection));
+    const gint64 wait_us = gint64(pacer.next_send - now) / GST_USECOND;
+    if (wait_us > pacer.delay_us_max.load(std::memory_order_relaxed))
+      pacer.delay_us_max.store(wait_us, std::memory_order_relaxed);
+
+    pacer.next_send += GstClockTime(size / bytes_per_us * GST_USECOND);
+    pacer.after.add(g_get_monotonic_time(), size);
+    return GST_PAD_PROBE_OK;
   }
-  static void on_offer_created_cb(GstPromise* promise, gpointer user_data)
+
+  //// Bandwidth estimate
+
+  // Each second, from the RTCP receiver reports of each WebRTC viewer, as
+  // webrtcbin's remote-inbound-rtp stats give them
+  void request_pacing_stats()
   {
-    gchar* sdp_string;
-    gchar* json_string;
-    JsonObject* sdp_json;
-    JsonObject* sdp_data_json;
-    GstStructure const* reply;
-    GstPromise* local_desc_promise;
-    GstWebRTCSessionDescription* offer = nullptr;
-    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    if (conf.pacing_factor <= 0.)
+      return;
+    for (auto& receiver : receivers)
+    {
+      if (!is_webrtc_viewer(*receiver) || receiver->quality == rendition::audio_only)
+        continue;
+      GstPromise* promise = gst_promise_new_with_change_func(
+            on_pacing_stats_cb,
+            new stats_request{
+                this,
+                receiver.get(),
+                (GstElement*)gst_object_ref(receiver->webrtcbin),
+                nullptr},
+            [](gpointer p) {
+              auto request = (stats_request*)p;
+              gst_object_unref(request->webrtcbin);
+              delete request;
+            });
+      g_signal_emit_by_name(receiver->webrtcbin, "get-stats", nullptr, promise);
+    }
+  }
 
-    reply = gst_promise_get_reply(promise);
-    gst_structure_get(
-          reply, "offer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, nullptr);
+  struct stats_request
+  {
+    Streamer* self;
+    ReceiverEntry* receiver_entry;
+    GstElement* webrtcbin;
+    GstStructure* stats;
+  };
+
+  // Runs on a webrtcbin thread, like on_offer_created_cb: the rates are
+  // updated from the main loop, which owns the receivers
+  static void on_pacing_stats_cb(GstPromise* promise, gpointer user_data)
+  {
+    auto request = (stats_request*)user_data;
+    const GstStructure* reply = gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED
+                                    ? gst_promise_get_reply(promise)
+                                    : nullptr;
+    if (reply)
+      g_main_context_invoke_full(
+            nullptr,
+            G_PRIORITY_DEFAULT,
+            apply_pacing_stats_cb,
+            new stats_request{
+                request->self,
+                request->receiver_entry,
+                (GstElement*)gst_object_ref(request->webrtcbin),
+                gst_structure_copy(reply)},
+            [](gpointer p) {
+              auto request = (stats_request*)p;
+              gst_structure_free(request->stats);
+              gst_object_unref(request->webrtcbin);
+              delete request;
+            });
     gst_promise_unref(promise);
+  }
 
-    local_desc_promise = gst_promise_new();
-    g_signal_emit_by_name(
-          receiver_entry->webrtcbin,
-          "set-local-description",
-          offer,
-          local_desc_promise);
-    gst_promise_interrupt(local_desc_promise);
-    gst_promise_unref(local_desc_promise);
+  static gboolean apply_pacing_stats_cb(gpointer user_data)
+  {
+    auto& request = *(stats_request*)user_data;
+    Streamer& self = *request.self;
+    for (auto& receiver : self.receivers)
+      if (receiver.get() == request.receiver_entry
+          && receiver->webrtcbin == request.webrtcbin)
+        self.update_pacing(*receiver, request.stats);
+    return G_SOURCE_REMOVE;
+  }
 
-    sdp_string = gst_sdp_message_as_text(offer->sdp);
-    gst_print("Negotiation offer created:\n%s\n", sdp_string);
+  // The payloader announces the SSRC in its caps, which the reports use
+  static bool track_ssrc(const track_input& track, guint& ssrc)
+  {
+    if (!track.webrtc_pad)
+      return false;
+    GstCaps* caps = gst_pad_get_current_caps(track.webrtc_pad);
+    if (!caps)
+      return false;
+    const bool found
+        = gst_structure_get_uint(gst_caps_get_structure(caps, 0), "ssrc", &ssrc);
+    gst_caps_unref(caps);
+    return found;
+  }
 
-    sdp_json = json_object_new();
-    json_object_set_string_member(sdp_json, "type", "sdp");
+  // Fraction of the packets of the SSRC lost, in the peer's last report
+  static bool remote_fraction_lost(const GstStructure* stats, guint ssrc, double& lost)
+  {
+    for (int i = 0; i < gst_structure_n_fields(stats); i++)
+    {
+      const GValue* value
+          = gst_structure_get_value(stats, gst_structure_nth_field_name(stats, i));
+      if (!GST_VALUE_HOLDS_STRUCTURE(value))
+        continue;
+
+      const GstStructure* report = gst_value_get_structure(value);
+      int type{};
+      guint report_ssrc{};
+      if (gst_structure_get_enum(report, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type)
+          && type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP
+          && gst_structure_get_uint(report, "ssrc", &report_ssrc) && report_ssrc == ssrc
+          && gst_structure_get_double(report, "fraction-lost", &lost))
+        return true;
+    }
+    return false;
+  }
 
-    sdp_data_json = json_object_new();
-    json_object_set_string_member(sdp_data_json, "type", "offer");
-    json_object_set_string_member(sdp_data_json, "sdp", sdp_string);
-    json_object_set_object_member(sdp_json, "data", sdp_data_json);
+  // Loss-based, as the loss controller of GCC: over 10% lost the rate
+  // backs off in proportion, under 2% it grows by 5% a report. It stays
+  // between the encoder bitrate and the pacing_factor ceiling.
+  void update_pacing(ReceiverEntry& receiver_entry, const GstStructure* stats)
+  {
+    for (auto& track : receiver_entry.tracks)
+    {
+      auto& pacer = track->pacer;
+      guint ssrc{};
+      double lost{};
+      if (track->kind != source_kind::video || !pacer.queue || !track_ssrc(*track, ssrc)
+          || !remote_fraction_lost(stats, ssrc, lost))
+        continue;
+
+      double rate = pacer.bytes_per_us.load(std::memory_order_relaxed);
+      if (lost > 0.1)
+        rate *= 1. - 0.5 * lost;
+      else if (lost < 0.02)
+        rate *= 1.05;
+      pacer.bytes_per_us = clamp_pacing_rate(*this, receiver_entry.quality, rate);
+    }
+  }
 
-    json_string = get_string_from_json_object(sdp_json);
-    json_object_unref(sdp_json);
+  static double clamp_pacing_rate(const Streamer& self, rendition quality, double rate)
+  {
+    const double ceiling = pacing_rate(self, quality);
+    return std::clamp(rate, std::min(encoder_rate(quality), ceiling), ceiling);
+  }
 
-    soup_websocket_connection_send_text(
-          receiver_entry->connection, json_string);
-    g_free(json_string);
-    g_free(sdp_string);
+  // Peak rates over burst_meter windows before and after the pacers, next
+  // to the mean rate of a video track, since the last query
+  JsonObject* pacing_to_json()
+  {
+    const gint64 now = g_get_monotonic_time();
+    const gint64 elapsed_us = std::max<gint64>(1, now - std::exchange(pacing_query_us, now));
+    auto kbps = [](uint64_t bytes, gint64 us) { return bytes * 8. * 1000. / us; };
+
+    double peak_before = 0., peak_after = 0.;
+    uint64_t bytes = 0;
+    int video_tracks = 0;
+    gint64 delay_us = 0;
+    uint64_t overruns = 0;
+    double rate_min = -1.;
+    for (auto& receiver : receivers)
+    {
+      for (auto& track : receiver->tracks)
+      {
+        if (track->kind != source_kind::video)
+          continue;
+        auto& pacer = track->pacer;
+        video_tracks++;
+        peak_before = std::max(
+              peak_before,
+              kbps(pacer.before.peak_window_bytes.exchange(0), burst_meter::window_us));
+        peak_after = std::max(
+              peak_after,
+              kbps(pacer.after.peak_window_bytes.exchange(0), burst_meter::window_us));
+        bytes += pacer.before.bytes.exchange(0);
+        pacer.after.bytes = 0;
+        delay_us = std::max(delay_us, pacer.delay_us_max.exchange(0));
+        overruns += pacer.overruns;
+        if (pacer.queue)
+        {
+          const double rate = pacer.bytes_per_us * 8. * 1000.;
+          rate_min = rate_min < 0. ? rate : std::min(rate_min, rate);
+        }
+      }
+    }
 
-    gst_webrtc_session_description_free(offer);
+    JsonObject* pacing = json_object_new();
+    json_object_set_double_member(pacing, "factor", conf.pacing_factor);
+    json_object_set_double_member(
+          pacing, "mean_kbps", video_tracks ? kbps(bytes, elapsed_us) / video_tracks : 0.);
+    json_object_set_double_member(pacing, "peak_kbps_before", peak_before);
+    json_object_set_double_member(pacing, "peak_kbps_after", peak_after);
+    json_object_set_double_member(pacing, "delay_ms_max", delay_us / 1000.);
+    json_object_set_int_member(pacing, "overruns", overruns);
+    // The lowest current rate, the bandwidth estimate where it bites
+    json_object_set_double_member(pacing, "rate_kbps_min", rate_min);
+    return pacing;
   }
-  static void
-  on_negotiation_needed_cb(GstElement* webrtcbin, gpointer user_data)
+
+#if defined(WITCHBRIDGE_TRACING)
+  struct trace_probe
   {
-    GstPromise* promise;
-    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    const char* stage;
+    track_input* track;
+    const ReceiverEntry* receiver;
+  };
 
-    gst_print("Creating negotiation offer\n");
+  static GstPadProbeReturn
+  trace_probe_cb(G_GNUC_UNUSED GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+  {
+    auto probe = (trace_probe*)user_data;
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!buffer || !GST_BUFFER_PTS_IS_VALID(buffer))
+      return GST_PAD_PROBE_OK;
+
+    if (auto frame = probe->track->find_recent(GST_BUFFER_PTS(buffer)))
+      trace_event(probe->stage, probe->track->kind, frame->id, probe->receiver);
+    return GST_PAD_PROBE_OK;
+  }
 
-    promise = gst_promise_new_with_change_func(
-                on_offer_created_cb, (gpointer)receiver_entry, nullptr);
-    g_signal_emit_by_name(
-          G_OBJECT(webrtcbin), "create-offer", nullptr, promise);
+  static void add_trace_probe(
+      const ReceiverEntry& receiver_entry, track_input& track, GstPad* pad, const char* stage)
+  {
+    if (!pad)
+      return;
+    gst_pad_add_probe(
+          pad,
+          GST_PAD_PROBE_TYPE_BUFFER,
+          trace_probe_cb,
+          new trace_probe{stage, &track, &receiver_entry},
+          [](gpointer p) { delete (trace_probe*)p; });
+    gst_object_unref(pad);
   }
-  static void on_ice_candidate_cb(
-      G_GNUC_UNUSED GstElement* webrtcbin,
-      guint mline_index,
-      gchar* candidate,
+
+  // The stages after the appsrc only see the PTS, which each track maps back
+  // to the frames it pushed.
+  static void add_trace_probes(ReceiverEntry& receiver_entry, track_input& track)
+  {
+    auto bin = GST_BIN(receiver_entry.pipeline);
+    const auto id = std::to_string(track.source);
+    for (auto [name, stage] : {std::pair{"enc_", "encoder"}, std::pair{"payloader_", "payloader"}})
+    {
+      if (GstElement* e = gst_bin_get_by_name(bin, (name + id).c_str()))
+      {
+        add_trace_probe(receiver_entry, track, gst_element_get_static_pad(e, "src"), stage);
+        gst_object_unref(e);
+      }
+    }
+    if (track.webrtc_pad)
+      add_trace_probe(
+            receiver_entry, track, (GstPad*)gst_object_ref(track.webrtc_pad), "webrtcbin");
+  }
+
+  static void soup_trace_handler(
+      G_GNUC_UNUSED SoupServer* soup_server,
+      SoupMessage* message,
+      G_GNUC_UNUSED const char* path,
+      G_GNUC_UNUSED GHashTable* query,
+      G_GNUC_UNUSED SoupClientContext* client_context,
       gpointer user_data)
   {
-    JsonObject* ice_json;
-    JsonObject* ice_data_json;
-    gchar* json_string;
-    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    Streamer& self = *(Streamer*)user_data;
+    if (!tracer.enabled || !tracer.write(self.conf.trace_path))
+    {
+      soup_message_set_status(message, SOUP_STATUS_SERVICE_UNAVAILABLE);
+      return;
+    }
+
+    gchar* body = g_strdup_printf(
+          "{\"path\":\"%s\",\"events\":%zu}",
+          self.conf.trace_path.c_str(),
+          std::min(tracer.count.load(), frame_tracer::capacity));
+    soup_message_set_response(
+          message, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+    soup_message_set_status(message, SOUP_STATUS_OK);
+  }
+#endif
+
+  static void setup_transceiver(
+      const Streamer& self, GstWebRTCRTPTransceiver* trans, source_kind kind)
+  {
+    const auto direction = self.conf.receive
+                               ? GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDRECV
+                               : GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY;
+    g_object_set(
+          trans,
+          "direction",
+          direction,
+          nullptr);
+
+    const std::string& track_priority
+        = kind == source_kind::video ? self.conf.video_priority : self.conf.audio_priority;
+    if (!track_priority.empty())
+    {
+      GstWebRTCPriorityType priority;
+
+      priority = _priority_from_string(track_priority.c_str());
+      if (priority)
+      {
+        GstWebRTCRTPSender* sender;
+
+        g_object_get(trans, "sender", &sender, nullptr);
+        gst_webrtc_rtp_sender_set_priority(sender, priority);
+        g_object_unref(sender);
+      }
+      else
+      {
+        g_warning("Unknown sender priority: %s", track_priority.c_str());
+      }
+    }
+  }
+
+  // The subscribed tracks this viewer's rendition can carry
+  std::vector<int> wanted_tracks(const ReceiverEntry& receiver_entry) const
+  {
+    auto selected = select_tracks(receiver_entry.subscription);
+    if (receiver_entry.quality == rendition::audio_only)
+      std::erase_if(selected, [this](int source) {
+        return sources[source]->kind == source_kind::video;
+      });
+    return selected;
+  }
+
+  //// Live track changes
+
+  // A producer appeared while the viewer is connected: its branch joins the
+  // running pipeline on a new webrtcbin pad, which makes webrtcbin ask for
+  // a new negotiation.
+  bool add_track(ReceiverEntry& receiver_entry, int source)
+  {
+    GError* error = nullptr;
+    GstElement* branch = gst_parse_bin_from_description(
+          track_branch(*this, source, receiver_entry.quality).c_str(), TRUE, &error);
+    if (error != nullptr)
+    {
+      g_warning("Could not create track branch: %s\n", error->message);
+      g_error_free(error);
+      if (branch)
+        gst_object_unref(branch);
+      return false;
+    }
+    gst_bin_add(GST_BIN(receiver_entry.pipeline), branch);
+
+    GstPad* sink = gst_element_request_pad_simple(receiver_entry.webrtcbin, "sink_%u");
+    GstPad* src = gst_element_get_static_pad(branch, "src");
+    const bool linked = sink && gst_pad_link(src, sink) == GST_PAD_LINK_OK;
+    gst_object_unref(src);
+    if (!linked)
+    {
+      g_warning("Could not link track branch to webrtcbin");
+      if (sink)
+      {
+        gst_element_release_request_pad(receiver_entry.webrtcbin, sink);
+        gst_object_unref(sink);
+      }
+      gst_bin_remove(GST_BIN(receiver_entry.pipeline), branch);
+      return false;
+    }
+
+    auto& track = *receiver_entry.tracks.emplace_back(std::make_unique<track_input>());
+    track.source = source;
+    track.generation = sources[source]->generation;
+    track.kind = sources[source]->kind;
+    track.webrtc_pad = sink;
+    setup_track(receiver_entry, *this, track);
+
+    GstWebRTCRTPTransceiver* trans = nullptr;
+    g_object_get(sink, "transceiver", &trans, nullptr);
+    if (trans)
+    {
+      setup_transceiver(*this, trans, track.kind);
+      gst_object_unref(trans);
+    }
+
+    gst_element_sync_state_with_parent(branch);
+    return true;
+  }
+
+  // A producer went away: its branch is stopped and taken out, and its
+  // transceiver made inactive. It keeps its codec so that webrtcbin can
+  // still describe it in the next offers.
+  void remove_track(ReceiverEntry& receiver_entry, track_input& track)
+  {
+    GstPad* pad = track.webrtc_pad;
+    if (!pad)
+      return;
+    detach_fmp4_tap(track);
+
+    GstWebRTCRTPTransceiver* trans = nullptr;
+    g_object_get(pad, "transceiver", &trans, nullptr);
+    if (trans)
+    {
+      if (GstCaps* caps = gst_pad_get_current_caps(pad))
+      {
+        g_object_set(trans, "codec-preferences", caps, nullptr);
+        gst_caps_unref(caps);
+      }
+      g_object_set(
+            trans, "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_INACTIVE, nullptr);
+      gst_object_unref(trans);
+    }
+
+    // Branches are a chain from the appsrc, or a bin when added live.
+    // Stopped before being unlinked: pushing into a stopped element is
+    // flushing, not the not-linked error that would restart the receiver.
+    std::vector<GstElement*> chain;
+    for (GstPad* peer = gst_pad_get_peer(pad); peer;)
+    {
+      GstElement* element = gst_pad_get_parent_element(peer);
+      gst_object_unref(peer);
+      if (!element)
+        break;
+      chain.push_back(element);
+      GstPad* sink = gst_element_get_static_pad(element, "sink");
+      peer = sink ? gst_pad_get_peer(sink) : nullptr;
+      if (sink)
+        gst_object_unref(sink);
+    }
+
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+      gst_element_set_state(*it, GST_STATE_NULL);
+    if (GstPad* peer = gst_pad_get_peer(pad))
+    {
+      gst_pad_unlink(peer, pad);
+      gst_object_unref(peer);
+    }
+    for (GstElement* element : chain)
+    {
+      gst_bin_remove(GST_BIN(receiver_entry.pipeline), element);
+      gst_object_unref(element);
+    }
+
+    gst_element_release_request_pad(receiver_entry.webrtcbin, pad);
+    if (track.appsrc)
+      gst_object_unref(std::exchange(track.appsrc, nullptr));
+  }
+
+  // Brings one viewer's pipeline to the tracks it wants, the ones it keeps
+  // untouched
+  void apply_tracks(ReceiverEntry& e)
+  {
+    const auto wanted = wanted_tracks(e);
+    for (auto it = e.tracks.begin(); it != e.tracks.end();)
+    {
+      auto& track = **it;
+      const bool current
+          = std::find(wanted.begin(), wanted.end(), track.source) != wanted.end()
+            && sources[track.source]->generation == track.generation;
+      if (current)
+      {
+        ++it;
+        continue;
+      }
+      remove_track(e, track);
+      it = e.tracks.erase(it);
+    }
+
+    if (!e.connection)
+      return;
+
+    for (int source : wanted)
+    {
+      const bool present = std::any_of(e.tracks.begin(), e.tracks.end(), [source](auto& t) {
+        return t->source == source;
+      });
+      if (!present)
+        add_track(e, source);
+    }
+  }
+
+  // Producers came or went: the viewers' pipelines follow, their other
+  // tracks untouched, and webrtcbin asks for the renegotiation once its
+  // pads changed. Only websocket viewers can be offered new tracks; WHEP
+  // ones and detached sessions only lose theirs. The fMP4 muxer has a
+  // fixed set of streams and is rebuilt, its viewers reconnecting.
+  void update_tracks()
+  {
+    const std::string listing = tracks_message();
+    for (auto& receiver : receivers)
+    {
+      auto& e = *receiver;
+      if (receiver == fmp4 || !e.pipeline || !e.webrtcbin)
+        continue;
+
+      apply_tracks(e);
+      if (e.connection)
+        send_tracks(e, listing);
+    }
+
+    if (fmp4 && fmp4_sources() != fmp4_current())
+      for (auto& client : fmp4_clients)
+        soup_websocket_connection_close(
+              client.connection, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, nullptr);
+
+    update_local_outputs();
+  }
+
+  static bool build_pipeline(ReceiverEntry& receiver_entry, Streamer& self)
+  {
+    // For the threads webrtcbin and libnice start on their own
+    std::optional<scoped_thread_settings> network;
+    if (self.conf.network_threads.enabled())
+      network.emplace(self.conf.network_threads);
+
+    receiver_entry.setup_start = g_get_monotonic_time();
+    receiver_entry.offer_pending = false;
+    receiver_entry.renegotiate = false;
+
+    GError* error = nullptr;
+    std::string pipeline = "webrtcbin latency=1 name=webrtcbin";
+    const auto& conf = self.conf;
+    if (conf.ice == ice_policy::stun && !conf.stun_server.empty())
+      pipeline += " stun-server=stun://" + conf.stun_server;
+    // A single ICE component per peer: one socket to gather and check
+    if (conf.ice != ice_policy::stun || conf.ice_min_port > 0)
+      pipeline += " bundle-policy=max-bundle";
+
+    // Only the subscribed tracks get encoded and sent to this viewer, each
+    // on its own transceiver, in the order of the description.
+    receiver_entry.tracks.clear();
+    for (int source : self.wanted_tracks(receiver_entry))
+    {
+      const auto kind = self.sources[source]->kind;
+      pipeline += track_branch(self, source, receiver_entry.quality) + " ! webrtcbin. ";
+
+      auto& track = *receiver_entry.tracks.emplace_back(std::make_unique<track_input>());
+      track.source = source;
+      track.generation = self.sources[source]->generation;
+      track.kind = kind;
+    }
+
+    receiver_entry.pipeline = gst_parse_launch(pipeline.c_str(), &error);
+    if (error != nullptr)
+    {
+      g_warning("Could not create WebRTC pipeline: %s\n", error->message);
+      g_error_free(error);
+      if (receiver_entry.pipeline)
+        gst_object_unref(receiver_entry.pipeline);
+      receiver_entry.pipeline = nullptr;
+      return false;
+    }
+
+    {
+      receiver_entry.webrtcbin
+          = gst_bin_get_by_name(GST_BIN(receiver_entry.pipeline), "webrtcbin");
+      g_assert(receiver_entry.webrtcbin != nullptr);
+
+      // webrtcbin requested its sink pads in the order of the tracks
+      for (std::size_t i = 0; i < receiver_entry.tracks.size(); i++)
+        receiver_entry.tracks[i]->webrtc_pad = gst_element_get_static_pad(
+              receiver_entry.webrtcbin, ("sink_" + std::to_string(i)).c_str());
+      setup_sources(receiver_entry, self);
+
+      // ICE policy, before anything gets gathered. The agent is only
+      // exposed since GStreamer 1.22; older ones gather on any port, with TCP.
+      if (g_object_class_find_property(
+              G_OBJECT_GET_CLASS(receiver_entry.webrtcbin), "ice-agent"))
+      {
+        GstObject* ice = nullptr;
+        g_object_get(receiver_entry.webrtcbin, "ice-agent", &ice, nullptr);
+        if (ice)
+        {
+          if (conf.ice_min_port > 0)
+            g_object_set(
+                  ice,
+                  "min-rtp-port", (guint)conf.ice_min_port,
+                  "max-rtp-port", (guint)std::max(conf.ice_min_port, conf.ice_max_port),
+                  nullptr);
+          if (conf.ice == ice_policy::host_udp)
+            g_object_set(ice, "ice-tcp", FALSE, nullptr);
+          gst_object_unref(ice);
+        }
+      }
+      else if (conf.ice_min_port > 0 || conf.ice == ice_policy::host_udp)
+      {
+        static bool warned = false;
+        if (!std::exchange(warned, true))
+          g_warning("GStreamer older than 1.22: no fixed ICE ports nor UDP only");
+      }
+
+      // Setup the webrtc internal latency
+      {
+        auto rtpbin = gst_bin_get_by_name(GST_BIN(receiver_entry.webrtcbin), "rtpbin");
+        g_assert_nonnull (rtpbin);
+        g_object_set(rtpbin, "latency", 10, nullptr);
+        // g_object_set(rtpbin, "sync", false, nullptr);
+        // g_object_set(rtpbin, "async", false, nullptr);
+        if (self.conf.receive)
+          g_signal_connect(
+                rtpbin,
+                "new-jitterbuffer",
+                G_CALLBACK(on_new_jitterbuffer_cb),
+                (gpointer)&receiver_entry);
+        g_object_unref(rtpbin);
+      }
+
+      // Setup transceivers
+      GArray* transceivers{};
+      g_signal_emit_by_name(
+            receiver_entry.webrtcbin, "get-transceivers", &transceivers);
+      g_assert(transceivers != nullptr && transceivers->len == receiver_entry.tracks.size());
+      for (guint i = 0; i < transceivers->len; i++)
+        setup_transceiver(
+              self,
+              g_array_index(transceivers, GstWebRTCRTPTransceiver*, i),
+              receiver_entry.tracks[i]->kind);
+      g_array_unref(transceivers);
+
+      if (self.conf.receive)
+      {
+        receiver_entry.remote_slot = self.claim_remote_slot();
+        g_signal_connect(
+              receiver_entry.webrtcbin,
+              "pad-added",
+              G_CALLBACK(on_incoming_stream_cb),
+              (gpointer)&receiver_entry);
+      }
+
+      g_signal_connect(
+            receiver_entry.webrtcbin,
+            "on-negotiation-needed",
+            G_CALLBACK(on_negotiation_needed_cb),
+            (gpointer)&receiver_entry);
+
+      g_signal_connect(
+            receiver_entry.webrtcbin,
+            "on-ice-candidate",
+            G_CALLBACK(on_ice_candidate_cb),
+            (gpointer)&receiver_entry);
+
+      GstBus* bus;
+      bus = gst_pipeline_get_bus(GST_PIPELINE(receiver_entry.pipeline));
+      receiver_entry.bus_watch = gst_bus_add_watch(bus, bus_watch_cb, &receiver_entry);
+      if (receiver_entry.id == 0)
+        receiver_entry.id = ++self.viewer_ids;
+      g_object_set_data(G_OBJECT(bus), "viewer", GINT_TO_POINTER(receiver_entry.id));
+      gst_bus_set_sync_handler(bus, bus_sync_cb, &self, nullptr);
+      gst_object_unref(bus);
+
+      g_signal_connect(
+            receiver_entry.webrtcbin,
+            "notify::ice-connection-state",
+            G_CALLBACK(on_ice_connection_state_cb),
+            (gpointer)&receiver_entry);
+    }
+
+    // Data channels have to be created once the pipeline is READY
+    gst_element_set_state(receiver_entry.pipeline, GST_STATE_READY);
+    {
+      g_signal_connect(
+            receiver_entry.webrtcbin,
+            "on-data-channel",
+            G_CALLBACK(on_data_channel_cb),
+            (gpointer)&receiver_entry);
+
+      // Unordered and without retransmissions: a late control value is
+      // superseded by the next one anyway.
+      GstStructure* options = gst_structure_new(
+            "options",
+            "ordered", G_TYPE_BOOLEAN, FALSE,
+            "max-retransmits", G_TYPE_INT, 0,
+            nullptr);
+      g_signal_emit_by_name(
+            receiver_entry.webrtcbin,
+            "create-data-channel",
+            "control",
+            options,
+            &receiver_entry.control_channel);
+      gst_structure_free(options);
+
+      if (receiver_entry.control_channel)
+        g_signal_connect(
+              receiver_entry.control_channel,
+              "on-message-data",
+              G_CALLBACK(on_control_message_cb),
+              (gpointer)&receiver_entry);
+      else
+        g_warning("Could not create the control data channel");
+    }
+
+    if (gst_element_set_state(receiver_entry.pipeline, GST_STATE_PLAYING)
+        == GST_STATE_CHANGE_FAILURE)
+    {
+      g_warning("Could not start pipeline");
+      finish_teardown(take_pipeline(receiver_entry));
+      return false;
+    }
+
+    return true;
+  }
+
+  static std::shared_ptr<ReceiverEntry> create_receiver_entry(
+      SoupWebsocketConnection* connection,
+      Streamer& self,
+      std::vector<std::string> subscription = {},
+      rendition quality = rendition::full,
+      const GstSDPMessage* offer = nullptr)
+  {
+    auto receiver_entry = std::make_shared<ReceiverEntry>();
+    receiver_entry->self = &self;
+    receiver_entry->connection = connection;
+    receiver_entry->subscription = std::move(subscription);
+    receiver_entry->quality = quality;
+    // Answering: the tracks may only use the extensions offered, as mapped
+    if (offer)
+      take_extension_ids(*receiver_entry, offer);
+
+    if (connection)
+    {
+      g_object_ref(G_OBJECT(connection));
+
+      g_signal_connect(
+            G_OBJECT(connection),
+            "message",
+            G_CALLBACK(soup_websocket_message_cb),
+            (gpointer)receiver_entry.get());
+    }
+
+    if (!build_pipeline(*receiver_entry, self))
+    {
+      if (connection)
+      {
+        g_signal_handlers_disconnect_by_data(connection, receiver_entry.get());
+        g_object_unref(G_OBJECT(connection));
+      }
+      return {};
+    }
+
+    return receiver_entry;
+  }
+
+  //// Receiving media from viewers
+
+  static void on_new_jitterbuffer_cb(
+      G_GNUC_UNUSED GstElement* rtpbin,
+      GstElement* jitterbuffer,
+      G_GNUC_UNUSED guint session,
+      G_GNUC_UNUSED guint ssrc,
+      gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    const auto& conf = receiver_entry->self->conf;
+
+    g_object_set(
+          jitterbuffer, "latency", (guint)conf.jitter_min_ms, "do-lost", TRUE, nullptr);
+
+    std::lock_guard _{receiver_entry->jitterbuffers_lock};
+    receiver_entry->jitterbuffers.push_back(
+          {.element = GST_ELEMENT(gst_object_ref(jitterbuffer))});
+  }
+
+  static GstFlowReturn on_remote_audio_sample_cb(GstElement* appsink, gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    Streamer& self = *receiver_entry->self;
+
+    GstSample* sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+    if (!sample)
+      return GST_FLOW_EOS;
+
+    if (receiver_entry->remote_slot >= 0)
+    {
+      GstBuffer* buffer = gst_sample_get_buffer(sample);
+      GstMapInfo map{};
+      gst_buffer_map(buffer, &map, GST_MAP_READ);
+      // If the host stopped pulling, what does not fit is dropped; whole
+      // buffers only so that the channels stay interleaved.
+      auto& queue = self.remote_peers[receiver_entry->remote_slot]->audio;
+      const auto samples = map.size / sizeof(float);
+      if (queue.write_available() >= samples)
+        queue.push((const float*)map.data, samples);
+      gst_buffer_unmap(buffer, &map);
+    }
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+  }
+
+  static GstFlowReturn on_remote_video_sample_cb(GstElement* appsink, gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    Streamer& self = *receiver_entry->self;
+
+    GstSample* sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+    if (!sample)
+      return GST_FLOW_EOS;
+
+    // The triple buffer has a single writer: the first viewer sending video
+    ReceiverEntry* expected = nullptr;
+    if (self.remote_video_owner.compare_exchange_strong(expected, receiver_entry)
+        || expected == receiver_entry)
+    {
+      GstVideoInfo info;
+      gst_video_info_from_caps(&info, gst_sample_get_caps(sample));
+
+      GstBuffer* buffer = gst_sample_get_buffer(sample);
+      GstMapInfo map{};
+      gst_buffer_map(buffer, &map, GST_MAP_READ);
+
+      auto& frame = self.remote_video.write_buffer();
+      frame.width = GST_VIDEO_INFO_WIDTH(&info);
+      frame.height = GST_VIDEO_INFO_HEIGHT(&info);
+      frame.bytes.resize(frame.width * frame.height * 4);
+      for (int y = 0; y < frame.height; y++)
+        memcpy(
+              frame.bytes.data() + y * frame.width * 4,
+              map.data + y * GST_VIDEO_INFO_PLANE_STRIDE(&info, 0),
+              frame.width * 4);
+      self.remote_video.publish();
+
+      gst_buffer_unmap(buffer, &map);
+    }
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+  }
+
+  static void on_incoming_decodebin_stream_cb(
+      G_GNUC_UNUSED GstElement* decodebin,
+      GstPad* pad,
+      gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    Streamer& self = *receiver_entry->self;
+
+    GstCaps* caps = gst_pad_get_current_caps(pad);
+    if (!caps)
+      caps = gst_pad_query_caps(pad, nullptr);
+    const gchar* name = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+
+    GError* error = nullptr;
+    GstElement* bin = nullptr;
+    GCallback on_sample = nullptr;
+    if (g_str_has_prefix(name, "video"))
+    {
+      bin = gst_parse_bin_from_description(
+            "queue max-size-buffers=1 leaky=downstream "
+            " ! videoconvert "
+            " ! video/x-raw,format=RGBA "
+            " ! appsink name=remotesink sync=false emit-signals=true max-buffers=1 drop=true",
+            TRUE,
+            &error);
+      on_sample = G_CALLBACK(on_remote_video_sample_cb);
+    }
+    else if (g_str_has_prefix(name, "audio"))
+    {
+      gchar* description = g_strdup_printf(
+            "queue max-size-time=20000000 leaky=downstream "
+            " ! audioconvert "
+            " ! audioresample "
+            " ! audio/x-raw,format=F32LE,layout=interleaved,channels=2,rate=%d "
+            " ! appsink name=remotesink sync=false emit-signals=true",
+            self.conf.rate);
+      bin = gst_parse_bin_from_description(description, TRUE, &error);
+      g_free(description);
+      on_sample = G_CALLBACK(on_remote_audio_sample_cb);
+    }
+    gst_caps_unref(caps);
+
+    if (error != nullptr)
+    {
+      g_warning("Could not create the receiving branch: %s\n", error->message);
+      g_error_free(error);
+      return;
+    }
+    if (!bin)
+      return;
+
+    GstElement* appsink = gst_bin_get_by_name(GST_BIN(bin), "remotesink");
+    g_signal_connect(appsink, "new-sample", on_sample, receiver_entry);
+    gst_object_unref(appsink);
+
+    gst_bin_add(GST_BIN(receiver_entry->pipeline), bin);
+    gst_element_sync_state_with_parent(bin);
+
+    GstPad* sinkpad = gst_element_get_static_pad(bin, "sink");
+    gst_pad_link(pad, sinkpad);
+    gst_object_unref(sinkpad);
+  }
+
+  static void on_incoming_stream_cb(
+      G_GNUC_UNUSED GstElement* webrtcbin,
+      GstPad* pad,
+      gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+
+    if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC)
+      return;
+
+    GstElement* decodebin = gst_element_factory_make("decodebin", nullptr);
+    g_signal_connect(
+          decodebin,
+          "pad-added",
+          G_CALLBACK(on_incoming_decodebin_stream_cb),
+          receiver_entry);
+    gst_bin_add(GST_BIN(receiver_entry->pipeline), decodebin);
+    gst_element_sync_state_with_parent(decodebin);
+
+    GstPad* sinkpad = gst_element_get_static_pad(decodebin, "sink");
+    gst_pad_link(pad, sinkpad);
+    gst_object_unref(sinkpad);
+  }
+
+  // The jitter buffers start at jitter_min_ms and follow the measured
+  // interarrival jitter, with extra margin while packets keep arriving late.
+  bool adapt_jitterbuffers()
+  {
+    double max_jitter = 0.;
+    double max_latency = 0.;
+    for (auto& receiver : receivers)
+    {
+      std::lock_guard _{receiver->jitterbuffers_lock};
+      for (auto& jb : receiver->jitterbuffers)
+      {
+        GstStructure* stats{};
+        g_object_get(jb.element, "stats", &stats, nullptr);
+        if (!stats)
+          continue;
+
+        guint64 num_late{}, avg_jitter{};
+        gst_structure_get_uint64(stats, "num-late", &num_late);
+        gst_structure_get_uint64(stats, "avg-jitter", &avg_jitter);
+        gst_structure_free(stats);
+
+        if (num_late > jb.num_late)
+          jb.margin_ms += 10.;
+        else
+          jb.margin_ms = std::max(0., jb.margin_ms - 1.);
+        jb.num_late = num_late;
+
+        const double jitter_ms = avg_jitter / double(GST_MSECOND);
+        const double latency_ms = std::clamp(
+              conf.jitter_min_ms + 4. * jitter_ms + jb.margin_ms,
+              double(conf.jitter_min_ms),
+              double(conf.jitter_max_ms));
+        g_object_set(jb.element, "latency", (guint)latency_ms, nullptr);
+
+        max_jitter = std::max(max_jitter, jitter_ms);
+        max_latency = std::max(max_latency, latency_ms);
+      }
+    }
+
+    remote_jitter_ms = max_jitter;
+    remote_latency_ms = max_latency;
+    return true;
+  }
+
+  int claim_remote_slot()
+  {
+    for (std::size_t i = 0; i < remote_peers.size(); i++)
+    {
+      bool expected = false;
+      if (remote_peers[i]->active.compare_exchange_strong(expected, true))
+        return i;
+    }
+    return -1;
+  }
+
+  // Control messages are decoded on the SCTP thread and handed to the
+  // avendish node through a bounded lock-free queue.
+  static void on_control_message_cb(
+      G_GNUC_UNUSED GstWebRTCDataChannel* channel,
+      GBytes* bytes,
+      gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+
+    gsize size{};
+    auto data = g_bytes_get_data(bytes, &size);
+    if (size != sizeof(wire_control_message))
+      return;
+
+    wire_control_message msg;
+    memcpy(&msg, data, sizeof(msg));
+
+    const double now = g_get_real_time() / 1000.;
+    receiver_entry->self->controls_received.push(control_message{
+          .channel = (int)msg.channel,
+          .value = msg.value,
+          .latency_ms = float(now - msg.timestamp)});
+  }
+
+  // Channels opened by the viewer, e.g. when it is the offerer with WHEP
+  static void on_data_channel_cb(
+      G_GNUC_UNUSED GstElement* webrtcbin,
+      GstWebRTCDataChannel* channel,
+      gpointer user_data)
+  {
+    g_signal_connect(
+          channel,
+          "on-message-data",
+          G_CALLBACK(on_control_message_cb),
+          user_data);
+  }
+  static void destroy_receiver_entry(gpointer receiver_entry_ptr)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)receiver_entry_ptr;
+
+    g_assert(receiver_entry != nullptr);
+    Streamer& self = *receiver_entry->self;
+
+    if (receiver_entry->grace_timeout)
+      g_source_remove(receiver_entry->grace_timeout);
+    receiver_entry->grace_timeout = 0;
+
+    for (auto& receiver : self.receivers)
+    {
+      if (receiver.get() == receiver_entry)
+      {
+        release_pipeline(receiver);
+        break;
+      }
+    }
+
+    if (receiver_entry->connection != nullptr)
+    {
+      g_signal_handlers_disconnect_by_data(
+            receiver_entry->connection, receiver_entry);
+      g_object_unref(G_OBJECT(receiver_entry->connection));
+      receiver_entry->connection = nullptr;
+    }
+
+    // A WHEP client may still be waiting for its answer
+    if (SoupMessage* message = std::exchange(receiver_entry->whep_message, nullptr))
+    {
+      soup_message_set_status(message, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+      soup_server_unpause_message(self.soup_server, message);
+    }
+  }
+
+  // Everything a running pipeline holds, moved out of its entry so that the
+  // entry can get a new pipeline while the old one is being torn down.
+  struct pipeline_teardown
+  {
+    std::shared_ptr<ReceiverEntry> entry;
+    Streamer* self{};
+    GstElement* pipeline{};
+    std::vector<gpointer> objects;
+    std::vector<jitterbuffer_state> jitterbuffers;
+    // Their appsrcs may still ask for data until the pipeline is stopped
+    std::vector<std::unique_ptr<track_input>> tracks;
+    int remote_slot = -1;
+  };
+
+  static pipeline_teardown* take_pipeline(ReceiverEntry& receiver_entry)
+  {
+    auto t = new pipeline_teardown;
+    t->self = receiver_entry.self;
+
+    if (receiver_entry.bus_watch)
+      g_source_remove(receiver_entry.bus_watch);
+    receiver_entry.bus_watch = 0;
+
+    // Late signals from the old pipeline must not reach the viewer
+    if (receiver_entry.webrtcbin)
+      g_signal_handlers_disconnect_by_data(receiver_entry.webrtcbin, &receiver_entry);
+    if (receiver_entry.control_channel)
+      g_signal_handlers_disconnect_by_data(receiver_entry.control_channel, &receiver_entry);
+
+    t->pipeline = std::exchange(receiver_entry.pipeline, nullptr);
+    for (gpointer object :
+         {(gpointer)std::exchange(receiver_entry.webrtcbin, nullptr),
+          (gpointer)std::exchange(receiver_entry.fmp4_sink, nullptr),
+          (gpointer)std::exchange(receiver_entry.control_channel, nullptr)})
+      if (object)
+        t->objects.push_back(object);
+    for (auto& track : receiver_entry.tracks)
+      if (track->appsrc)
+        t->objects.push_back(std::exchange(track->appsrc, nullptr));
+    t->tracks = std::move(receiver_entry.tracks);
+    receiver_entry.tracks.clear();
+
+    {
+      std::lock_guard _{receiver_entry.jitterbuffers_lock};
+      t->jitterbuffers = std::move(receiver_entry.jitterbuffers);
+      receiver_entry.jitterbuffers.clear();
+    }
+
+    t->remote_slot = std::exchange(receiver_entry.remote_slot, -1);
+    return t;
+  }
+
+  static void finish_teardown(pipeline_teardown* t)
+  {
+    if (t->pipeline)
+    {
+      gst_element_set_state(t->pipeline, GST_STATE_NULL);
+      gst_object_unref(t->pipeline);
+    }
+    for (auto object : t->objects)
+      g_object_unref(object);
+    for (auto& jb : t->jitterbuffers)
+      gst_object_unref(jb.element);
+
+    // No streaming thread can write to these anymore
+    if (t->remote_slot >= 0)
+      t->self->remote_peers[t->remote_slot]->active = false;
+    ReceiverEntry* expected = t->entry.get();
+    if (expected)
+      t->self->remote_video_owner.compare_exchange_strong(expected, nullptr);
+
+    delete t;
+  }
+
+  // The state change to NULL happens on a GStreamer worker thread: closing
+  // DTLS and ICE can take a while and must not stall the main loop that
+  // feeds the other viewers. The entry is kept alive until then, as
+  // streaming threads may still call back into it.
+  static void release_pipeline(std::shared_ptr<ReceiverEntry> receiver_entry)
+  {
+    auto t = take_pipeline(*receiver_entry);
+    t->entry = std::move(receiver_entry);
+
+    if (!t->pipeline || t->self->quitting)
+    {
+      finish_teardown(t);
+      return;
+    }
+
+    GstElement* pipeline = t->pipeline;
+    gst_element_call_async(
+          pipeline,
+          +[](G_GNUC_UNUSED GstElement* element, gpointer user_data) {
+            finish_teardown((pipeline_teardown*)user_data);
+          },
+          t,
+          nullptr);
+  }
+
+  //// Fault isolation
+
+  struct receiver_ref
+  {
+    Streamer* self;
+    ReceiverEntry* entry;
+  };
+
+  static gboolean restart_receiver_cb(gpointer user_data)
+  {
+    auto ref = (receiver_ref*)user_data;
+    Streamer& self = *ref->self;
+    for (auto& receiver : self.receivers)
+    {
+      if (receiver.get() == ref->entry)
+      {
+        self.restart_receiver(receiver);
+        break;
+      }
+    }
+    delete ref;
+    return G_SOURCE_REMOVE;
+  }
+
+  static void on_ice_connection_state_cb(
+      GstElement* webrtcbin,
+      G_GNUC_UNUSED GParamSpec* pspec,
+      gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    GstWebRTCICEConnectionState state{};
+    g_object_get(webrtcbin, "ice-connection-state", &state, nullptr);
+
+    // WHEP sessions have no websocket closing to tell when their peer is gone
+    if (!receiver_entry->whep_id.empty())
+    {
+      auto& self = *receiver_entry->self;
+      if (state == GST_WEBRTC_ICE_CONNECTION_STATE_FAILED
+          || state == GST_WEBRTC_ICE_CONNECTION_STATE_CLOSED)
+        g_idle_add(whep_expire_cb, new whep_pending{&self, receiver_entry->whep_id});
+      else if (state == GST_WEBRTC_ICE_CONNECTION_STATE_DISCONNECTED)
+        g_timeout_add(
+              self.conf.whep_disconnect_timeout_ms,
+              whep_expire_cb,
+              new whep_pending{&self, receiver_entry->whep_id});
+    }
+
+    if (state != GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED
+        && state != GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED)
+      return;
+
+    if (gint64 start = receiver_entry->setup_start.exchange(0))
+    {
+      auto& stats = receiver_entry->self->stats;
+      const double setup_ms = (g_get_monotonic_time() - start) / 1000.;
+      stats.setup_ms_last = setup_ms;
+      stats.setup_ms_mean = stats.setups == 0
+                                ? setup_ms
+                                : 0.9 * stats.setup_ms_mean + 0.1 * setup_ms;
+      stats.setups++;
+    }
+
+    if (gint64 start = receiver_entry->resume_start.exchange(0))
+    {
+      auto& stats = receiver_entry->self->stats;
+      const double resume_ms = (g_get_monotonic_time() - start) / 1000.;
+      stats.resume_ms_last = resume_ms;
+      stats.resume_ms_mean = stats.resumes == 0
+                                 ? resume_ms
+                                 : 0.9 * stats.resume_ms_mean + 0.1 * resume_ms;
+      stats.resumes++;
+    }
+
+    // End of an outage: the restarted peer is connected again
+    if (gint64 start = receiver_entry->outage_start.exchange(0))
+    {
+      auto& stats = receiver_entry->self->stats;
+      const double outage_ms = (g_get_monotonic_time() - start) / 1000.;
+      stats.outage_ms_total += outage_ms;
+      stats.outage_ms_last = outage_ms;
+      stats.recovered++;
+    }
+  }
+
+  // Rebuilds the pipeline of one receiver after an error. Websocket viewers
+  // are told to start over with a new peer connection; WHEP ones and
+  // detached sessions cannot be renegotiated and are dropped, as are the
+  // fMP4 viewers, which reconnect.
+  // A receiver failing more than 3 times in 10 seconds is given up on.
+  void restart_receiver(std::shared_ptr<ReceiverEntry> receiver_entry)
+  {
+    const gint64 now = g_get_monotonic_time();
+    auto& e = *receiver_entry;
+    e.restart_pending = false;
+
+    if (receiver_entry == fmp4 || receiver_entry == fmp4_encoder)
+    {
+      for (auto& client : fmp4_clients)
+        soup_websocket_connection_close(
+              client.connection, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, nullptr);
+      stats.dropped++;
+      return;
+    }
+
+    // Opened again when the tracks change next
+    if (!e.local_socket.empty())
+    {
+      g_warning("Dropping local output %s after pipeline error", e.local_socket.c_str());
+      stats.dropped++;
+      std::erase(local_outputs, receiver_entry);
+      remove_receiver(*this, &e);
+      return;
+    }
+
+    if (now - e.restart_window_start > 10 * G_USEC_PER_SEC)
+    {
+      e.restart_window_start = now;
+      e.restarts_in_window = 0;
+    }
+
+    if (!e.connection || ++e.restarts_in_window > 3)
+    {
+      g_warning("Dropping receiver %p after pipeline error", (gpointer)&e);
+      stats.dropped++;
+      // Closed on purpose: not to be resumed
+      e.session_token.clear();
+      if (e.connection)
+        soup_websocket_connection_close(
+              e.connection, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, nullptr);
+      else
+        remove_receiver(*this, &e);
+      return;
+    }
+
+    if (!rebuild_receiver(receiver_entry))
+    {
+      stats.dropped++;
+      return;
+    }
+
+    const double restart_ms = (g_get_monotonic_time() - now) / 1000.;
+    stats.restarts++;
+    stats.restart_ms_last = restart_ms;
+    stats.restart_ms_max = std::max(stats.restart_ms_max.load(), restart_ms);
+  }
+
+  // New pipeline and peer connection for a websocket viewer, e.g. after an
+  // error or when it changed its subscription.
+  bool rebuild_receiver(std::shared_ptr<ReceiverEntry> receiver_entry)
+  {
+    auto& e = *receiver_entry;
+    release_pipeline(receiver_entry);
+    soup_websocket_connection_send_text(
+          e.connection, "{\"type\":\"restart\",\"data\":{}}");
+
+    if (!build_pipeline(e, *this))
+    {
+      e.session_token.clear();
+      soup_websocket_connection_close(
+            e.connection, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, nullptr);
+      return false;
+    }
+    return true;
+  }
+
+  // Track names, as a comma-separated list or a JSON array
+  static std::vector<std::string> parse_subscription(const char* list)
+  {
+    std::vector<std::string> names;
+    if (!list)
+      return names;
+
+    gchar** split = g_strsplit(list, ",", -1);
+    for (gchar** name = split; *name; ++name)
+      if (**name)
+        names.push_back(*name);
+    g_strfreev(split);
+    return names;
+  }
+
+  static std::vector<std::string> parse_subscription(JsonArray* list)
+  {
+    std::vector<std::string> names;
+    for (guint i = 0; i < json_array_get_length(list); i++)
+      if (const gchar* name = json_array_get_string_element(list, i))
+        names.push_back(name);
+    return names;
+  }
+
+  static void soup_stats_handler(
+      G_GNUC_UNUSED SoupServer* soup_server,
+      SoupMessage* message,
+      G_GNUC_UNUSED const char* path,
+      G_GNUC_UNUSED GHashTable* query,
+      G_GNUC_UNUSED SoupClientContext* client_context,
+      gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
+
+    JsonObject* stats_json = json_object_new();
+    json_object_set_int_member(stats_json, "receivers", self.receivers.size());
+    json_object_set_int_member(stats_json, "errors", self.stats.errors);
+    json_object_set_int_member(stats_json, "restarts", self.stats.restarts);
+    json_object_set_int_member(stats_json, "recovered", self.stats.recovered);
+    json_object_set_int_member(stats_json, "dropped", self.stats.dropped);
+    json_object_set_double_member(
+          stats_json, "restart_ms_last", self.stats.restart_ms_last);
+    json_object_set_double_member(
+          stats_json, "restart_ms_max", self.stats.restart_ms_max);
+    json_object_set_double_member(
+          stats_json, "outage_ms_last", self.stats.outage_ms_last);
+    json_object_set_double_member(
+          stats_json, "outage_ms_total", self.stats.outage_ms_total);
+    json_object_set_string_member(
+          stats_json, "ice_policy", ice_policy_name(self.conf.ice));
+    json_object_set_int_member(stats_json, "rejected", self.stats.rejected);
+    json_object_set_int_member(stats_json, "degraded", self.stats.degraded);
+    json_object_set_int_member(stats_json, "setups", self.stats.setups);
+    json_object_set_double_member(
+          stats_json, "setup_ms_last", self.stats.setup_ms_last);
+    json_object_set_double_member(
+          stats_json, "setup_ms_mean", self.stats.setup_ms_mean);
+    json_object_set_int_member(stats_json, "resumes", self.stats.resumes);
+    json_object_set_int_member(stats_json, "expired", self.stats.expired);
+    json_object_set_double_member(
+          stats_json, "resume_ms_last", self.stats.resume_ms_last);
+    json_object_set_double_member(
+          stats_json, "resume_ms_mean", self.stats.resume_ms_mean);
+    // The maximum is over the time since the last query
+    double jitter_mean = 0.;
+    int64_t jitter_max = 0;
+    double queue_mean = 0.;
+    int64_t queue_max = 0;
+    for (auto& src : self.sources)
+    {
+      if (src->state != Source::active || src->kind != source_kind::audio)
+        continue;
+      jitter_mean = std::max(jitter_mean, src->callback_jitter_us_mean.load());
+      jitter_max = std::max(jitter_max, src->callback_jitter_us_max.exchange(0));
+      queue_mean = std::max(queue_mean, src->queue_wait_us_mean.load());
+      queue_max = std::max(queue_max, src->queue_wait_us_max.exchange(0));
+    }
+    uint64_t video_skipped = 0;
+    for (auto& src : self.sources)
+      if (src->state == Source::active && src->kind == source_kind::video)
+        video_skipped += src->video_frames_skipped;
+    json_object_set_double_member(
+          stats_json, "callback_jitter_us_mean", jitter_mean);
+    json_object_set_int_member(
+          stats_json, "callback_jitter_us_max", jitter_max);
+    json_object_set_double_member(stats_json, "audio_queue_us_mean", queue_mean);
+    json_object_set_int_member(stats_json, "audio_queue_us_max", queue_max);
+    json_object_set_int_member(stats_json, "video_deferred", self.stats.video_deferred);
+    json_object_set_int_member(stats_json, "video_frames_skipped", video_skipped);
+    if (self.shm)
+    {
+      // Frames the host could not hand over, all slots being in use
+      uint64_t shm_dropped = 0;
+      for (auto& in : self.shm->sources)
+        shm_dropped += in.video_frames_dropped.load(std::memory_order_relaxed);
+      json_object_set_int_member(stats_json, "shm_frames_dropped", shm_dropped);
+      json_object_set_int_member(stats_json, "server_starts", self.shm->server_starts);
+    }
+    json_object_set_array_member(stats_json, "tracks", self.tracks_to_json());
+    json_object_set_array_member(stats_json, "playout", self.playout_to_json());
+    json_object_set_object_member(stats_json, "e2e_latency", self.latency_to_json());
+    json_object_set_object_member(stats_json, "pacing", self.pacing_to_json());
+
+    gchar* json_string = get_string_from_json_object(stats_json);
+    json_object_unref(stats_json);
+
+    soup_message_set_response(
+          message, "application/json", SOUP_MEMORY_TAKE, json_string, strlen(json_string));
+    soup_message_set_status(message, SOUP_STATUS_OK);
+  }
+
+  static void remove_receiver(Streamer& self, ReceiverEntry* receiver_entry)
+  {
+    // The table owns the pipeline teardown: it has to run while the entry
+    // is still alive, i.e. before it is erased from the receivers.
+    g_hash_table_remove(self.receiver_entry_table, receiver_entry);
+
+    for (auto it = self.receivers.begin(); it != self.receivers.end(); ++it)
+    {
+      if (it->get() == receiver_entry)
+      {
+        self.receivers.erase(it);
+        break;
+      }
+    }
+  }
+
+  // What an offer was created for: the receiver may have been rebuilt
+  // with another webrtcbin, or be gone, by the time it is ready
+  struct offer_request
+  {
+    Streamer* self;
+    ReceiverEntry* receiver_entry;
+    GstElement* webrtcbin;
+    GstWebRTCSessionDescription* offer;
+  };
+
+  // Runs on a webrtcbin thread: the offer is sent from the main loop, which
+  // owns the receivers and their websockets
+  static void on_offer_created_cb(GstPromise* promise, gpointer user_data)
+  {
+    auto request = (offer_request*)user_data;
+    GstStructure const* reply;
+    GstWebRTCSessionDescription* offer = nullptr;
+
+    GError* error = nullptr;
+    reply = gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED
+                ? gst_promise_get_reply(promise)
+                : nullptr;
+    if (!reply)
+      g_warning("Offer not created");
+    else if (gst_structure_get(reply, "error", G_TYPE_ERROR, &error, nullptr))
+      g_warning("Offer not created: %s", error->message);
+    else
+      gst_structure_get(
+            reply, "offer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, nullptr);
+    g_clear_error(&error);
+    gst_promise_unref(promise);
+
+    g_main_context_invoke_full(
+          nullptr,
+          G_PRIORITY_DEFAULT,
+          send_offer_cb,
+          new offer_request{
+              request->self,
+              request->receiver_entry,
+              (GstElement*)gst_object_ref(request->webrtcbin),
+              offer},
+          [](gpointer p) {
+            auto request = (offer_request*)p;
+            if (request->offer)
+              gst_webrtc_session_description_free(request->offer);
+            gst_object_unref(request->webrtcbin);
+            delete request;
+          });
+  }
+
+  static gboolean send_offer_cb(gpointer user_data)
+  {
+    auto& request = *(offer_request*)user_data;
+    Streamer& self = *request.self;
+    const bool alive
+        = std::any_of(self.receivers.begin(), self.receivers.end(), [&](auto& receiver) {
+            return receiver.get() == request.receiver_entry;
+          });
+    if (!alive)
+      return G_SOURCE_REMOVE;
+
+    ReceiverEntry* receiver_entry = request.receiver_entry;
+    GstWebRTCSessionDescription* offer = request.offer;
+
+    // Detached sessions get a new offer, with an ICE restart, on resume
+    if (!offer || request.webrtcbin != receiver_entry->webrtcbin
+        || !receiver_entry->connection)
+    {
+      if (request.webrtcbin == receiver_entry->webrtcbin)
+      {
+        std::lock_guard lock{receiver_entry->negotiation_lock};
+        receiver_entry->offer_pending = false;
+        receiver_entry->renegotiate = false;
+      }
+      return G_SOURCE_REMOVE;
+    }
+
+    GstPromise* local_desc_promise = gst_promise_new();
+    g_signal_emit_by_name(
+          receiver_entry->webrtcbin,
+          "set-local-description",
+          offer,
+          local_desc_promise);
+    gst_promise_interrupt(local_desc_promise);
+    gst_promise_unref(local_desc_promise);
+
+    gchar* sdp_string = gst_sdp_message_as_text(offer->sdp);
+    gst_print("Negotiation offer created:\n%s\n", sdp_string);
+
+    JsonObject* sdp_json = json_object_new();
+    json_object_set_string_member(sdp_json, "type", "sdp");
+
+    JsonObject* sdp_data_json = json_object_new();
+    json_object_set_string_member(sdp_data_json, "type", "offer");
+    json_object_set_string_member(sdp_data_json, "sdp", sdp_string);
+    json_object_set_object_member(sdp_json, "data", sdp_data_json);
+
+    gchar* json_string = get_string_from_json_object(sdp_json);
+    json_object_unref(sdp_json);
+
+    soup_websocket_connection_send_text(
+          receiver_entry->connection, json_string);
+    g_free(json_string);
+    g_free(sdp_string);
+    return G_SOURCE_REMOVE;
+  }
+  static void
+  on_negotiation_needed_cb(GstElement* webrtcbin, gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+
+    // WHEP clients are the offerers
+    if (receiver_entry->connection == nullptr)
+      return;
+
+    gst_print("Creating negotiation offer\n");
+    create_offer(*receiver_entry, nullptr);
+  }
+
+  // An offer with options, i.e. an ICE restart, is never deferred: the
+  // pending one was lost with the previous websocket.
+  static void create_offer(ReceiverEntry& receiver_entry, GstStructure* options)
+  {
+    {
+      std::lock_guard lock{receiver_entry.negotiation_lock};
+      if (receiver_entry.offer_pending && !options)
+      {
+        receiver_entry.renegotiate = true;
+        return;
+      }
+      receiver_entry.offer_pending = true;
+    }
+
+    GstPromise* promise = gst_promise_new_with_change_func(
+          on_offer_created_cb,
+          new offer_request{
+              receiver_entry.self,
+              &receiver_entry,
+              (GstElement*)gst_object_ref(receiver_entry.webrtcbin),
+              nullptr},
+          [](gpointer p) {
+            auto request = (offer_request*)p;
+            gst_object_unref(request->webrtcbin);
+            delete request;
+          });
+    g_signal_emit_by_name(
+          G_OBJECT(receiver_entry.webrtcbin), "create-offer", options, promise);
+  }
+  static void on_ice_candidate_cb(
+      G_GNUC_UNUSED GstElement* webrtcbin,
+      guint mline_index,
+      gchar* candidate,
+      gpointer user_data)
+  {
+    JsonObject* ice_json;
+    JsonObject* ice_data_json;
+    gchar* json_string;
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+
+    // WHEP answers carry the candidates gathered so far in the SDP itself
+    if (receiver_entry->connection == nullptr)
+      return;
+
+    ice_json = json_object_new();
+    json_object_set_string_member(ice_json, "type", "ice");
+
+    ice_data_json = json_object_new();
+    json_object_set_int_member(ice_data_json, "sdpMLineIndex", mline_index);
+    json_object_set_string_member(ice_data_json, "candidate", candidate);
+    json_object_set_object_member(ice_json, "data", ice_data_json);
+
+    json_string = get_string_from_json_object(ice_json);
+
+    // std::cerr << "on_ice_candidate_cb: JSON OUTPUT: '" << json_string << "'\n";
+    json_object_unref(ice_json);
+
+    soup_websocket_connection_send_text(
+          receiver_entry->connection, json_string);
+    g_free(json_string);
+  }
+
+  static void soup_websocket_message_cb(
+      G_GNUC_UNUSED SoupWebsocketConnection* connection,
+      SoupWebsocketDataType data_type,
+      GBytes* message,
+      gpointer user_data)
+  {
+    gsize size;
+    gchar* data;
+    gchar* data_string;
+    const gchar* type_string;
+    JsonNode* root_json;
+    JsonObject* root_json_object;
+    JsonObject* data_json_object;
+    JsonParser* json_parser = nullptr;
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+
+    switch (data_type)
+    {
+    case SOUP_WEBSOCKET_DATA_BINARY:
+      g_warning("Received unknown binary message, ignoring\n");
+      g_bytes_unref(message);
+      return;
+
+    case SOUP_WEBSOCKET_DATA_TEXT:
+      data = (gchar*)g_bytes_unref_to_data(message, &size);
+      /* Convert to nullptr-terminated string */
+      data_string = g_strndup(data, size);
+      g_free(data);
+      break;
+
+    default:
+      g_assert_not_reached();
+    }
+
+    json_parser = json_parser_new();
+    if (!json_parser_load_from_data(json_parser, data_string, -1, nullptr))
+      goto unknown_message;
+
+    root_json = json_parser_get_root(json_parser);
+    if (!JSON_NODE_HOLDS_OBJECT(root_json))
+      goto unknown_message;
+
+    root_json_object = json_node_get_object(root_json);
+
+    if (!json_object_has_member(root_json_object, "type"))
+    {
+      g_warning("Received message without type field\n");
+      goto cleanup;
+    }
+    type_string = json_object_get_string_member(root_json_object, "type");
+
+    if (!json_object_has_member(root_json_object, "data"))
+    {
+      g_warning("Received message without data field\n");
+      goto cleanup;
+    }
+    data_json_object = json_object_get_object_member(root_json_object, "data");
+
+    if (g_strcmp0(type_string, "sdp") == 0)
+    {
+      const gchar* sdp_type_string;
+      const gchar* sdp_string;
+      GstPromise* promise;
+      GstSDPMessage* sdp;
+      GstWebRTCSessionDescription* answer;
+      int ret;
+
+      if (!json_object_has_member(data_json_object, "type"))
+      {
+        g_warning("Received SDP message without type field\n");
+        goto cleanup;
+      }
+      sdp_type_string
+          = json_object_get_string_member(data_json_object, "type");
+
+      if (g_strcmp0(sdp_type_string, "answer") != 0)
+      {
+        g_warning(
+              "Expected SDP message type \"answer\", got \"%s\"\n",
+              sdp_type_string);
+        goto cleanup;
+      }
+
+      if (!json_object_has_member(data_json_object, "sdp"))
+      {
+        g_warning("Received SDP message without SDP string\n");
+        goto cleanup;
+      }
+      sdp_string = json_object_get_string_member(data_json_object, "sdp");
+
+      gst_print("Received SDP:\n%s\n", sdp_string);
+
+      ret = gst_sdp_message_new(&sdp);
+      g_assert_cmphex(ret, ==, GST_SDP_OK);
+
+      ret = gst_sdp_message_parse_buffer(
+              (guint8*)sdp_string, strlen(sdp_string), sdp);
+      if (ret != GST_SDP_OK)
+      {
+        g_warning("Could not parse SDP string\n");
+        goto cleanup;
+      }
+      // Extensions left out of the answer are not written from now on
+      take_extension_ids(*receiver_entry, sdp);
+
+      answer = gst_webrtc_session_description_new(
+                 GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+      g_assert_nonnull(answer);
+
+      promise = gst_promise_new();
+      g_signal_emit_by_name(
+            receiver_entry->webrtcbin,
+            "set-remote-description",
+            answer,
+            promise);
+      gst_promise_interrupt(promise);
+      gst_promise_unref(promise);
+      gst_webrtc_session_description_free(answer);
+
+      bool renegotiate;
+      {
+        std::lock_guard lock{receiver_entry->negotiation_lock};
+        receiver_entry->offer_pending = false;
+        renegotiate = std::exchange(receiver_entry->renegotiate, false);
+      }
+      if (renegotiate)
+        create_offer(*receiver_entry, nullptr);
+    }
+    else if (g_strcmp0(type_string, "ice") == 0)
+    {
+      guint mline_index;
+      const gchar* candidate_string;
+
+      if (!json_object_has_member(data_json_object, "sdpMLineIndex"))
+      {
+        g_warning("Received ICE message without mline index\n");
+        goto cleanup;
+      }
+      mline_index
+          = json_object_get_int_member(data_json_object, "sdpMLineIndex");
+
+      if (!json_object_has_member(data_json_object, "candidate"))
+      {
+        g_warning("Received ICE message without ICE candidate string\n");
+        goto cleanup;
+      }
+      candidate_string
+          = json_object_get_string_member(data_json_object, "candidate");
+
+      gst_print(
+            "Received ICE candidate with mline index %u; candidate: %s\n",
+            mline_index,
+            candidate_string);
+
+      g_signal_emit_by_name(
+            receiver_entry->webrtcbin,
+            "add-ice-candidate",
+            mline_index,
+            candidate_string);
+    }
+    else if (g_strcmp0(type_string, "report") == 0)
+    {
+      if (json_object_has_member(data_json_object, "tracks"))
+        apply_report(
+              *receiver_entry, json_object_get_array_member(data_json_object, "tracks"));
+    }
+    else if (g_strcmp0(type_string, "subscribe") == 0)
+    {
+      if (!json_object_has_member(data_json_object, "tracks"))
+      {
+        g_warning("Received subscribe message without tracks\n");
+        goto cleanup;
+      }
+
+      // Applied in place, as for producers coming and going: only the
+      // tracks added or removed are renegotiated
+      Streamer& self = *receiver_entry->self;
+      auto subscription = parse_subscription(
+            json_object_get_array_member(data_json_object, "tracks"));
+      const auto quality = self.readmit(*receiver_entry, subscription);
+      if (!quality)
+      {
+        g_warning("Subscription over capacity, keeping the current one");
+        self.stats.rejected++;
+      }
+      else if (receiver_entry->pipeline)
+      {
+        receiver_entry->subscription = std::move(subscription);
+        if (*quality != receiver_entry->quality)
+          self.set_rendition(*receiver_entry, *quality);
+        self.apply_tracks(*receiver_entry);
+      }
+    }
+    else
+      goto unknown_message;
+
+cleanup:
+    if (json_parser != nullptr)
+      g_object_unref(G_OBJECT(json_parser));
+    g_free(data_string);
+    return;
+
+unknown_message:
+    g_warning("Unknown message \"%s\", ignoring", data_string);
+    goto cleanup;
+  }
+
+  static void soup_websocket_closed_cb(
+      SoupWebsocketConnection* connection,
+      gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
+
+    for (auto& receiver : self.receivers)
+    {
+      if (receiver->connection == connection)
+      {
+        if (self.conf.resume_grace_ms > 0 && !receiver->session_token.empty())
+          self.detach_receiver(*receiver);
+        else
+          remove_receiver(self, receiver.get());
+        break;
+      }
+    }
+  }
+
+  //// Session resume
+
+  static void send_session(SoupWebsocketConnection* connection, const std::string& token)
+  {
+    const std::string json
+        = "{\"type\":\"session\",\"data\":{\"token\":\"" + token + "\"}}";
+    soup_websocket_connection_send_text(connection, json.c_str());
+  }
+
+  // The websocket is gone but the pipeline and the peer connection stay up,
+  // media included, until the viewer resumes or the grace period ends.
+  void detach_receiver(ReceiverEntry& e)
+  {
+    g_signal_handlers_disconnect_by_data(e.connection, &e);
+    g_object_unref(G_OBJECT(e.connection));
+    e.connection = nullptr;
+
+    e.grace_timeout = g_timeout_add_full(
+          G_PRIORITY_DEFAULT,
+          conf.resume_grace_ms,
+          session_expired_cb,
+          new receiver_ref{this, &e},
+          [](gpointer ref) { delete (receiver_ref*)ref; });
+  }
+
+  static gboolean session_expired_cb(gpointer user_data)
+  {
+    auto ref = (receiver_ref*)user_data;
+    Streamer& self = *ref->self;
+    for (auto& receiver : self.receivers)
+    {
+      if (receiver.get() == ref->entry)
+      {
+        receiver->grace_timeout = 0;
+        self.stats.expired++;
+        remove_receiver(self, receiver.get());
+        break;
+      }
+    }
+    return G_SOURCE_REMOVE;
+  }
+
+  // Hands a detached session its new websocket and restarts ICE: the
+  // viewer may be on another network now. DTLS, the decoders and the
+  // pipeline are all kept.
+  bool resume_receiver(SoupWebsocketConnection* connection, const char* token)
+  {
+    ReceiverEntry* detached = find_detached(token);
+    if (!detached)
+      return false;
+
+    auto& e = *detached;
+    g_source_remove(e.grace_timeout);
+    e.grace_timeout = 0;
+
+    e.connection = connection;
+    g_object_ref(G_OBJECT(connection));
+    g_signal_connect(
+          G_OBJECT(connection),
+          "message",
+          G_CALLBACK(soup_websocket_message_cb),
+          (gpointer)&e);
+
+    e.tracks_sent.clear();
+    send_tracks(e, tracks_message());
+    send_session(connection, e.session_token);
+
+    e.resume_start = g_get_monotonic_time();
+    GstStructure* options
+        = gst_structure_new("options", "ice-restart", G_TYPE_BOOLEAN, TRUE, nullptr);
+    create_offer(e, options);
+    gst_structure_free(options);
+    return true;
+  }
+
+  ReceiverEntry* find_detached(const char* token) const
+  {
+    if (!token)
+      return nullptr;
+    for (auto& receiver : receivers)
+      if (!receiver->connection && receiver->grace_timeout
+          && receiver->session_token == token)
+        return receiver.get();
+    return nullptr;
+  }
+
+  static const char* ice_policy_name(ice_policy policy)
+  {
+    switch (policy)
+    {
+    case ice_policy::host_only:
+      return "host_only";
+    case ice_policy::host_udp:
+      return "host_udp";
+    default:
+      return "stun";
+    }
+  }
+
+  // What the page passes to RTCPeerConnection: no STUN server for the
+  // host-only policies, so that browsers do not wait on it either.
+  std::string ice_servers_json() const
+  {
+    if (conf.ice != ice_policy::stun || conf.stun_server.empty())
+      return "[]";
+    return "[{ \"urls\": \"stun:" + conf.stun_server + "\" }]";
+  }
+
+  static void soup_http_handler(
+      G_GNUC_UNUSED SoupServer* soup_server,
+      SoupMessage* message,
+      const char* path,
+      G_GNUC_UNUSED GHashTable* query,
+      G_GNUC_UNUSED SoupClientContext* client_context,
+      gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
+
+    if ((g_strcmp0(path, "/") != 0) && (g_strcmp0(path, "/index.html") != 0))
+    {
+      soup_message_set_status(message, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
+
+    static boost::iostreams::mapped_file mmap(
+          "webrtc.html",
+          boost::iostreams::mapped_file::readonly);
+    std::string page(mmap.const_data(), mmap.size());
+    static constexpr std::string_view placeholder = "%ICE_SERVERS%";
+    if (auto pos = page.find(placeholder); pos != std::string::npos)
+      page.replace(pos, placeholder.size(), self.ice_servers_json());
+
+    soup_message_headers_set_content_type(
+          message->response_headers, "text/html", nullptr);
+    soup_message_body_append(
+          message->response_body, SOUP_MEMORY_COPY, page.data(), page.size());
+
+    soup_message_set_status(message, SOUP_STATUS_OK);
+  }
+
+  static void soup_websocket_handler(
+      G_GNUC_UNUSED SoupServer* server,
+      SoupWebsocketConnection* connection,
+      G_GNUC_UNUSED const char* path,
+      G_GNUC_UNUSED SoupClientContext* client_context,
+      gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
+    GHashTable* receiver_entry_table = self.receiver_entry_table;
+
+    gst_print("Processing new websocket connection %p", (gpointer)connection);
+
+    g_signal_connect(
+          G_OBJECT(connection),
+          "closed",
+          G_CALLBACK(soup_websocket_closed_cb),
+          &self);
+
+    // Viewers can pick their tracks up front with ?tracks=a,b, and come
+    // back to their session with ?resume=<token>
+    std::vector<std::string> subscription;
+    if (const char* query = soup_uri_get_query(soup_websocket_connection_get_uri(connection)))
+    {
+      GHashTable* form = soup_form_decode(query);
+      subscription = parse_subscription((const char*)g_hash_table_lookup(form, "tracks"));
+      const char* token = (const char*)g_hash_table_lookup(form, "resume");
+      const bool resumed = token && self.resume_receiver(connection, token);
+      g_hash_table_destroy(form);
+      if (resumed)
+        return;
+    }
+
+    // Checked before the upgrade already, but the load may have changed
+    auto quality = self.admit(subscription);
+    if (!quality)
+    {
+      self.stats.rejected++;
+      soup_websocket_connection_close(connection, 1013, "Over capacity");
+      return;
+    }
+
+    std::string listing = self.tracks_message();
+    soup_websocket_connection_send_text(connection, listing.c_str());
+
+    // Before the offer, which may come from another thread: a viewer that
+    // failed to resume learns from the new token to start over
+    std::string token;
+    if (self.conf.resume_grace_ms > 0)
+    {
+      gchar* uuid = g_uuid_string_random();
+      token = uuid;
+      g_free(uuid);
+      send_session(connection, token);
+    }
+
+    auto receiver_entry
+        = create_receiver_entry(connection, self, std::move(subscription), *quality);
+    if (!receiver_entry)
+    {
+      soup_websocket_connection_close(
+            connection, SOUP_WEBSOCKET_CLOSE_SERVER_ERROR, nullptr);
+      return;
+    }
+    receiver_entry->session_token = std::move(token);
+    receiver_entry->tracks_sent = std::move(listing);
+    self.receivers.push_back(receiver_entry);
+    g_hash_table_replace(
+          receiver_entry_table, receiver_entry.get(), receiver_entry.get());
+  }
+
+  //// Admission control
+
+  static int video_kbps(rendition quality)
+  {
+    return quality == rendition::low ? 600 : 2400;
+  }
+
+  // Nominal outgoing bitrate of a viewer, from the encoder settings
+  int viewer_kbps(const std::vector<std::string>& subscription, rendition quality) const
+  {
+    int kbps = 0;
+    for (int source : select_tracks(subscription))
+    {
+      if (sources[source]->kind == source_kind::audio)
+        kbps += 128;
+      else if (quality != rendition::audio_only)
+        kbps += video_kbps(quality);
+    }
+    return kbps;
+  }
+
+  // Share of a full viewer's CPU cost: encoding scales with the pixels
+  static double cpu_share(rendition quality)
+  {
+    switch (quality)
+    {
+    case rendition::low:
+      return 0.25;
+    case rendition::audio_only:
+      return 0.05;
+    default:
+      return 1.;
+    }
+  }
+
+  // New viewers get the best rendition that still fits the budgets, with
+  // the CPU cost estimated from what the current viewers measure. Nothing
+  // when over capacity.
+  std::optional<rendition> admit(const std::vector<std::string>& subscription) const
+  {
+    if (conf.max_viewers > 0 && webrtc_viewers() >= conf.max_viewers)
+      return {};
+
+    for (auto quality : {rendition::full, rendition::low, rendition::audio_only})
+    {
+      if (conf.cpu_budget > 0.
+          && load.viewer_cores + load.cores_per_viewer * cpu_share(quality) > conf.cpu_budget)
+        continue;
+      if (conf.bandwidth_budget_kbps > 0
+          && load.kbps + viewer_kbps(subscription, quality) > conf.bandwidth_budget_kbps)
+        continue;
+      return quality;
+    }
+    return {};
+  }
+
+  // For a viewer changing its subscription: the same budgets, with what it
+  // uses now given back, at its rendition or a lower one
+  std::optional<rendition> readmit(
+      const ReceiverEntry& receiver_entry,
+      const std::vector<std::string>& subscription) const
+  {
+    const double other_cores = load.viewer_cores - receiver_entry.cores;
+    const int other_kbps
+        = load.kbps - viewer_kbps(receiver_entry.subscription, receiver_entry.quality);
+    for (auto quality : {rendition::full, rendition::low, rendition::audio_only})
+    {
+      if (quality < receiver_entry.quality)
+        continue;
+      if (conf.cpu_budget > 0.
+          && other_cores + load.cores_per_viewer * cpu_share(quality) > conf.cpu_budget)
+        continue;
+      if (conf.bandwidth_budget_kbps > 0
+          && other_kbps + viewer_kbps(subscription, quality) > conf.bandwidth_budget_kbps)
+        continue;
+      return quality;
+    }
+    return {};
+  }
+
+  // The fMP4 pipeline and local outputs are not viewers
+  bool is_webrtc_viewer(const ReceiverEntry& receiver_entry) const
+  {
+    return receiver_entry.webrtcbin && receiver_entry.local_socket.empty();
+  }
+
+  int webrtc_viewers() const
+  {
+    return std::count_if(receivers.begin(), receivers.end(), [this](auto& receiver) {
+      return is_webrtc_viewer(*receiver);
+    });
+  }
+
+  static void reject_over_capacity(SoupMessage* message)
+  {
+    soup_message_headers_replace(message->response_headers, "Retry-After", "5");
+    soup_message_set_status(message, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  }
+
+  // Runs before the websocket upgrade, so that refused viewers get a 503
+  static void soup_admission_handler(
+      G_GNUC_UNUSED SoupServer* soup_server,
+      SoupMessage* message,
+      G_GNUC_UNUSED const char* path,
+      GHashTable* query,
+      G_GNUC_UNUSED SoupClientContext* client_context,
+      gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
+    // Resumed sessions were admitted already
+    if (query && self.find_detached((const char*)g_hash_table_lookup(query, "resume")))
+      return;
+
+    auto subscription = parse_subscription(
+          query ? (const char*)g_hash_table_lookup(query, "tracks") : nullptr);
+    if (!self.admit(subscription))
+    {
+      self.stats.rejected++;
+      reject_over_capacity(message);
+    }
+  }
+
+  // CPU time of a thread, in clock ticks, and the viewer it runs for
+  static bool read_thread_cpu(const char* tid, uint64_t& ticks, int& viewer)
+  {
+    gchar* stat = nullptr;
+    const std::string path = std::string("/proc/self/task/") + tid + "/stat";
+    if (!g_file_get_contents(path.c_str(), &stat, nullptr, nullptr))
+      return false;
+
+    // pid (comm) state ... utime stime: the 14th and 15th fields
+    bool ok = false;
+    char* open = strchr(stat, '(');
+    char* close = strrchr(stat, ')');
+    if (open && close > open)
+    {
+      *close = '\0';
+      viewer = thread_viewer(open + 1);
+      unsigned long long utime{}, stime{};
+      ok = sscanf(close + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                  &utime, &stime) == 2;
+      ticks = utime + stime;
+    }
+    g_free(stat);
+    return ok;
+  }
+
+  // CPU of each viewer, sampled every second: that of the threads named
+  // after it, its streaming threads and x264's. The host's own threads and
+  // the other pipelines do not count.
+  bool update_load()
+  {
+#if defined(__linux__)
+    std::unordered_map<int, uint64_t> thread_ticks;
+    std::unordered_map<int, uint64_t> viewer_ticks;
+    if (GDir* dir = g_dir_open("/proc/self/task", 0, nullptr))
+    {
+      while (const gchar* tid = g_dir_read_name(dir))
+      {
+        uint64_t ticks{};
+        int viewer{};
+        if (!read_thread_cpu(tid, ticks, viewer))
+          continue;
+        thread_ticks[atoi(tid)] = ticks;
+        auto last = load.thread_ticks.find(atoi(tid));
+        if (viewer && last != load.thread_ticks.end() && ticks >= last->second)
+          viewer_ticks[viewer] += ticks - last->second;
+      }
+      g_dir_close(dir);
+    }
+    load.thread_ticks = std::move(thread_ticks);
+
+    const gint64 now = g_get_monotonic_time();
+    if (load.last_sample_us > 0)
+    {
+      const double seconds = double(now - load.last_sample_us) / G_USEC_PER_SEC;
+      const double ticks_per_s = sysconf(_SC_CLK_TCK);
+      load.viewer_cores = 0.;
+      double full_viewers = 0.;
+      for (auto& receiver : receivers)
+      {
+        if (!is_webrtc_viewer(*receiver))
+          continue;
+        const double cores = viewer_ticks[receiver->id] / ticks_per_s / seconds;
+        receiver->cores = 0.7 * receiver->cores + 0.3 * cores;
+        load.viewer_cores += receiver->cores;
+        full_viewers += cpu_share(receiver->quality);
+      }
+      if (full_viewers > 0.)
+        load.cores_per_viewer = load.viewer_cores / full_viewers;
+    }
+    load.last_sample_us = now;
+#endif
+
+    load.kbps = 0;
+    for (auto& receiver : receivers)
+      if (is_webrtc_viewer(*receiver))
+        load.kbps += viewer_kbps(receiver->subscription, receiver->quality);
+
+    request_pacing_stats();
+    shed_load();
+    return G_SOURCE_CONTINUE;
+  }
+
+  // Over the CPU budget, the newest full-quality viewer is moved to the
+  // low rendition, one per second until the load fits again.
+  void shed_load()
+  {
+    if (conf.cpu_budget <= 0. || load.viewer_cores <= conf.cpu_budget * 1.1)
+      return;
+
+    for (auto it = receivers.rbegin(); it != receivers.rend(); ++it)
+    {
+      auto& receiver = *it;
+      if (is_webrtc_viewer(*receiver) && receiver->quality == rendition::full)
+      {
+        set_rendition(*receiver, rendition::low);
+        stats.degraded++;
+        return;
+      }
+    }
+  }
+
+  // In place, the peer connection untouched: the scaler and the encoder
+  // are reconfigured, and x264 starts over with a keyframe at the new
+  // size. Only between video renditions, audio_only has no video branch.
+  void set_rendition(ReceiverEntry& receiver_entry, rendition quality)
+  {
+    receiver_entry.quality = quality;
+    auto bin = GST_BIN(receiver_entry.pipeline);
+    for (auto& track : receiver_entry.tracks)
+    {
+      if (track->kind != source_kind::video)
+        continue;
+
+      const auto id = std::to_string(track->source);
+      if (GstElement* scale = gst_bin_get_by_name(bin, ("scale_" + id).c_str()))
+      {
+        GstCaps* caps = gst_caps_from_string(scaled_caps(quality).c_str());
+        g_object_set(scale, "caps", caps, nullptr);
+        gst_caps_unref(caps);
+        gst_object_unref(scale);
+      }
+      if (GstElement* encoder = gst_bin_get_by_name(bin, ("enc_" + id).c_str()))
+      {
+        g_object_set(encoder, "bitrate", guint(video_kbps(quality)), nullptr);
+        gst_object_unref(encoder);
+      }
+      // The estimate carries over, within the bounds of the new bitrate
+      track->pacer.bytes_per_us = clamp_pacing_rate(
+            *this, quality, track->pacer.bytes_per_us.load(std::memory_order_relaxed));
+    }
+  }
+
+  static void soup_load_handler(
+      G_GNUC_UNUSED SoupServer* soup_server,
+      SoupMessage* message,
+      G_GNUC_UNUSED const char* path,
+      G_GNUC_UNUSED GHashTable* query,
+      G_GNUC_UNUSED SoupClientContext* client_context,
+      gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
+    const auto next = self.admit({});
+
+    JsonObject* load_json = json_object_new();
+    json_object_set_int_member(load_json, "viewers", self.webrtc_viewers());
+    json_object_set_int_member(load_json, "max_viewers", self.conf.max_viewers);
+    json_object_set_double_member(load_json, "viewer_cpu_cores", self.load.viewer_cores);
+    json_object_set_double_member(load_json, "cpu_cores_per_viewer", self.load.cores_per_viewer);
+    json_object_set_double_member(load_json, "cpu_budget", self.conf.cpu_budget);
+    json_object_set_int_member(load_json, "bandwidth_kbps", self.load.kbps);
+    json_object_set_int_member(
+          load_json, "bandwidth_budget_kbps", self.conf.bandwidth_budget_kbps);
+    json_object_set_boolean_member(load_json, "accepting", next.has_value());
+    if (next)
+      json_object_set_string_member(
+            load_json,
+            "next_rendition",
+            *next == rendition::full ? "full" : *next == rendition::low ? "low" : "audio_only");
+
+    gchar* json_string = get_string_from_json_object(load_json);
+    json_object_unref(load_json);
+
+    // Balancers can go by the status alone
+    soup_message_set_response(
+          message, "application/json", SOUP_MEMORY_TAKE, json_string, strlen(json_string));
+    soup_message_set_status(
+          message, next ? SOUP_STATUS_OK : SOUP_STATUS_SERVICE_UNAVAILABLE);
+  }
+
+  //// WHEP
+
+  struct whep_pending
+  {
+    Streamer* self;
+    std::string id;
+  };
+
+  static ReceiverEntry* find_whep_receiver(Streamer& self, const char* id)
+  {
+    for (auto& receiver : self.receivers)
+      if (!receiver->whep_id.empty() && receiver->whep_id == id)
+        return receiver.get();
+    return nullptr;
+  }
+
+  // Runs on the main loop, once ICE gathering completed or timed out
+  static gboolean whep_send_answer(gpointer user_data)
+  {
+    auto pending = (whep_pending*)user_data;
+    Streamer& self = *pending->self;
+    ReceiverEntry* receiver_entry = find_whep_receiver(self, pending->id.c_str());
+    delete pending;
+
+    if (!receiver_entry || !receiver_entry->whep_message)
+      return G_SOURCE_REMOVE;
+
+    SoupMessage* message = receiver_entry->whep_message;
+    receiver_entry->whep_message = nullptr;
+
+    GstWebRTCSessionDescription* answer = nullptr;
+    g_object_get(
+          receiver_entry->webrtcbin, "local-description", &answer, nullptr);
+    if (!answer)
+    {
+      soup_message_set_status(message, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+      soup_server_unpause_message(self.soup_server, message);
+      return G_SOURCE_REMOVE;
+    }
+
+    gchar* sdp_string = gst_sdp_message_as_text(answer->sdp);
+    gst_webrtc_session_description_free(answer);
+    gst_print("WHEP answer created:\n%s\n", sdp_string);
+
+    gchar* location = g_strdup_printf("/whep/%s", receiver_entry->whep_id.c_str());
+    soup_message_headers_replace(message->response_headers, "Location", location);
+    g_free(location);
+
+    soup_message_set_response(
+          message, "application/sdp", SOUP_MEMORY_TAKE, sdp_string, strlen(sdp_string));
+    soup_message_set_status(message, SOUP_STATUS_CREATED);
+    soup_server_unpause_message(self.soup_server, message);
+    return G_SOURCE_REMOVE;
+  }
+
+  // The client gave up before its answer was sent: libsoup is done with the
+  // message, and nobody is left to play the session
+  static void on_whep_message_finished_cb(SoupMessage* message, gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
+    for (auto& receiver : self.receivers)
+    {
+      if (receiver->whep_message == message)
+      {
+        receiver->whep_message = nullptr;
+        gst_print("WHEP client left before its answer\n");
+        remove_receiver(self, receiver.get());
+        return;
+      }
+    }
+  }
+
+  // Runs on the main loop, when the ICE connection of a WHEP session failed,
+  // closed, or has been disconnected for whep_disconnect_timeout_ms
+  static gboolean whep_expire_cb(gpointer user_data)
+  {
+    auto pending = (whep_pending*)user_data;
+    Streamer& self = *pending->self;
+    ReceiverEntry* receiver_entry = find_whep_receiver(self, pending->id.c_str());
+    delete pending;
+    if (!receiver_entry || !receiver_entry->webrtcbin)
+      return G_SOURCE_REMOVE;
+
+    GstWebRTCICEConnectionState state{};
+    g_object_get(receiver_entry->webrtcbin, "ice-connection-state", &state, nullptr);
+    if (state == GST_WEBRTC_ICE_CONNECTION_STATE_FAILED
+        || state == GST_WEBRTC_ICE_CONNECTION_STATE_DISCONNECTED
+        || state == GST_WEBRTC_ICE_CONNECTION_STATE_CLOSED)
+    {
+      g_warning("Dropping WHEP session %s, its peer is gone", receiver_entry->whep_id.c_str());
+      self.stats.dropped++;
+      remove_receiver(self, receiver_entry);
+    }
+    return G_SOURCE_REMOVE;
+  }
+
+  static void on_whep_gathering_state_cb(
+      GstElement* webrtcbin,
+      G_GNUC_UNUSED GParamSpec* pspec,
+      gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    GstWebRTCICEGatheringState state{};
+    g_object_get(webrtcbin, "ice-gathering-state", &state, nullptr);
+
+    if (state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE)
+      g_idle_add(
+            whep_send_answer,
+            new whep_pending{receiver_entry->self, receiver_entry->whep_id});
+  }
+
+  static void on_whep_local_description_set_cb(GstPromise* promise, gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    gst_promise_unref(promise);
+
+    // Whatever has been gathered when the timeout fires goes in the answer,
+    // the client can still trickle its own candidates with PATCH.
+    g_timeout_add(
+          receiver_entry->self->conf.whep_ice_timeout_ms,
+          whep_send_answer,
+          new whep_pending{receiver_entry->self, receiver_entry->whep_id});
+  }
+
+  static void on_whep_answer_created_cb(GstPromise* promise, gpointer user_data)
+  {
+    GstWebRTCSessionDescription* answer = nullptr;
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+
+    const GstStructure* reply = gst_promise_get_reply(promise);
+    gst_structure_get(
+          reply, "answer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, nullptr);
+    gst_promise_unref(promise);
+
+    if (!answer)
+    {
+      g_warning("Could not create WHEP answer");
+      g_timeout_add(
+            0,
+            whep_send_answer,
+            new whep_pending{receiver_entry->self, receiver_entry->whep_id});
+      return;
+    }
+
+    GstPromise* local_desc_promise = gst_promise_new_with_change_func(
+          on_whep_local_description_set_cb, receiver_entry, nullptr);
+    g_signal_emit_by_name(
+          receiver_entry->webrtcbin,
+          "set-local-description",
+          answer,
+          local_desc_promise);
+    gst_webrtc_session_description_free(answer);
+  }
+
+  static void on_whep_remote_description_set_cb(GstPromise* promise, gpointer user_data)
+  {
+    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    gst_promise_unref(promise);
+
+    promise = gst_promise_new_with_change_func(
+          on_whep_answer_created_cb, receiver_entry, nullptr);
+    g_signal_emit_by_name(
+          receiver_entry->webrtcbin, "create-answer", nullptr, promise);
+  }
+
+  static void whep_create_session(Streamer& self, SoupMessage* message, GHashTable* query)
+  {
+    const char* content_type = soup_message_headers_get_content_type(
+          message->request_headers, nullptr);
+    if (g_strcmp0(content_type, "application/sdp") != 0)
+    {
+      soup_message_set_status(message, SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE);
+      return;
+    }
+
+    GstSDPMessage* sdp;
+    gst_sdp_message_new(&sdp);
+
+    SoupBuffer* body = soup_message_body_flatten(message->request_body);
+    int ret = gst_sdp_message_parse_buffer((guint8*)body->data, body->length, sdp);
+    soup_buffer_free(body);
+    if (ret != GST_SDP_OK)
+    {
+      g_warning("Could not parse WHEP offer\n");
+      gst_sdp_message_free(sdp);
+      soup_message_set_status(message, SOUP_STATUS_BAD_REQUEST);
+      return;
+    }
+
+    auto subscription = parse_subscription(
+          query ? (const char*)g_hash_table_lookup(query, "tracks") : nullptr);
+    auto quality = self.admit(subscription);
+    if (!quality)
+    {
+      gst_sdp_message_free(sdp);
+      self.stats.rejected++;
+      reject_over_capacity(message);
+      return;
+    }
+
+    // The answer only covers the m-lines offered: the first subscribed
+    // track of each kind, unless the client offered more transceivers.
+    auto receiver_entry
+        = create_receiver_entry(nullptr, self, std::move(subscription), *quality, sdp);
+    if (!receiver_entry)
+    {
+      gst_sdp_message_free(sdp);
+      soup_message_set_status(message, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+      return;
+    }
+
+    gchar* id = g_uuid_string_random();
+    receiver_entry->whep_id = id;
+    g_free(id);
+    receiver_entry->whep_message = message;
+
+    self.receivers.push_back(receiver_entry);
+    g_hash_table_replace(
+          self.receiver_entry_table, receiver_entry.get(), receiver_entry.get());
+
+    g_signal_connect(
+          receiver_entry->webrtcbin,
+          "notify::ice-gathering-state",
+          G_CALLBACK(on_whep_gathering_state_cb),
+          receiver_entry.get());
+
+    soup_server_pause_message(self.soup_server, message);
+    g_signal_connect(message, "finished", G_CALLBACK(on_whep_message_finished_cb), &self);
+
+    GstWebRTCSessionDescription* offer
+        = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_OFFER, sdp);
+    GstPromise* promise = gst_promise_new_with_change_func(
+          on_whep_remote_description_set_cb, receiver_entry.get(), nullptr);
+    g_signal_emit_by_name(
+          receiver_entry->webrtcbin, "set-remote-description", offer, promise);
+    gst_webrtc_session_description_free(offer);
+  }
+
+  // Trickle ICE from the client, as an application/trickle-ice-sdpfrag body
+  static void whep_add_candidates(ReceiverEntry& receiver_entry, SoupMessage* message)
+  {
+    GstWebRTCSessionDescription* offer = nullptr;
+    g_object_get(
+          receiver_entry.webrtcbin, "remote-description", &offer, nullptr);
+    if (!offer)
+    {
+      soup_message_set_status(message, SOUP_STATUS_CONFLICT);
+      return;
+    }
+
+    SoupBuffer* body = soup_message_body_flatten(message->request_body);
+    gchar* fragment = g_strndup(body->data, body->length);
+    soup_buffer_free(body);
+
+    gchar** lines = g_strsplit(fragment, "\n", -1);
+    int mline_index = -1;
+    for (gchar** line = lines; *line; ++line)
+    {
+      g_strstrip(*line);
+      if (g_str_has_prefix(*line, "a=mid:"))
+      {
+        const gchar* mid = *line + strlen("a=mid:");
+        mline_index = -1;
+        for (guint i = 0; i < gst_sdp_message_medias_len(offer->sdp); i++)
+        {
+          auto media = gst_sdp_message_get_media(offer->sdp, i);
+          if (g_strcmp0(gst_sdp_media_get_attribute_val(media, "mid"), mid) == 0)
+          {
+            mline_index = i;
+            break;
+          }
+        }
+      }
+      else if (g_str_has_prefix(*line, "a=candidate:") && mline_index >= 0)
+      {
+        g_signal_emit_by_name(
+              receiver_entry.webrtcbin,
+              "add-ice-candidate",
+              (guint)mline_index,
+              *line + strlen("a="));
+      }
+    }
+
+    g_strfreev(lines);
+    g_free(fragment);
+    gst_webrtc_session_description_free(offer);
+    soup_message_set_status(message, SOUP_STATUS_NO_CONTENT);
+  }
+
+  static void soup_whep_handler(
+      G_GNUC_UNUSED SoupServer* soup_server,
+      SoupMessage* message,
+      const char* path,
+      GHashTable* query,
+      G_GNUC_UNUSED SoupClientContext* client_context,
+      gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
+
+    soup_message_headers_replace(
+          message->response_headers, "Access-Control-Allow-Origin", "*");
+    soup_message_headers_replace(
+          message->response_headers, "Access-Control-Expose-Headers", "Location");
+
+    if (message->method == SOUP_METHOD_OPTIONS)
+    {
+      soup_message_headers_replace(
+            message->response_headers,
+            "Access-Control-Allow-Methods",
+            "POST, PATCH, DELETE, OPTIONS");
+      soup_message_headers_replace(
+            message->response_headers,
+            "Access-Control-Allow-Headers",
+            "Content-Type");
+      soup_message_set_status(message, SOUP_STATUS_NO_CONTENT);
+      return;
+    }
+
+    if (g_strcmp0(path, "/whep") == 0)
+    {
+      if (message->method == SOUP_METHOD_POST)
+        whep_create_session(self, message, query);
+      else
+        soup_message_set_status(message, SOUP_STATUS_METHOD_NOT_ALLOWED);
+      return;
+    }
+
+    if (!g_str_has_prefix(path, "/whep/"))
+    {
+      soup_message_set_status(message, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
+
+    ReceiverEntry* receiver_entry
+        = find_whep_receiver(self, path + strlen("/whep/"));
+    if (!receiver_entry)
+    {
+      soup_message_set_status(message, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
+
+    if (message->method == SOUP_METHOD_DELETE)
+    {
+      remove_receiver(self, receiver_entry);
+      soup_message_set_status(message, SOUP_STATUS_OK);
+    }
+    else if (g_strcmp0(message->method, "PATCH") == 0)
+    {
+      whep_add_candidates(*receiver_entry, message);
+    }
+    else
+    {
+      soup_message_set_status(message, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    }
+  }
+
+  //// fMP4 over websocket
+
+  // A single muxing pipeline serves every fMP4 viewer: it is created with the
+  // first one, its output fanned out as-is. It carries the first video and
+  // audio tracks, what MSE players expect, already encoded: see
+  // update_fmp4_input. Fragments are shorter than a video frame, so that each
+  // frame leaves as soon as it is muxed, with the audio in between.
+  static std::shared_ptr<ReceiverEntry> create_fmp4_entry(Streamer& self)
+  {
+    auto receiver_entry = std::make_shared<ReceiverEntry>();
+    receiver_entry->self = &self;
+
+    GError* error = nullptr;
+    gchar* pipeline_mux = g_strdup_printf(
+          " mp4mux name=mux streamable=true fragment-duration=%d "
+          " ! appsink name=fmp4sink sync=false ",
+          self.conf.fmp4_fragment_ms);
+    std::string pipeline = pipeline_mux;
+    g_free(pipeline_mux);
+
+    // The encoders run in other pipelines, which may change: their
+    // timestamps are rebased onto this one, see fmp4_timeline
+    self.fmp4_tracks = self.fmp4_sources();
+    self.fmp4_time = std::make_shared<fmp4_timeline>();
+    for (auto [source, generation] : self.fmp4_tracks)
+    {
+      pipeline += " appsrc name=fmp4src_" + std::to_string(source)
+                  + " is-live=true format=time leaky-type=2 ! ";
+      if (self.sources[source]->kind == source_kind::video)
+        pipeline += " h264parse "
+                    " ! video/x-h264,stream-format=avc,alignment=au "
+                    " ! mux.video_%u ";
+      else
+        pipeline += " mux.audio_%u ";
+    }
+
+    if (self.fmp4_tracks.empty())
+    {
+      g_warning("No track to send to fMP4 viewers\n");
+      return {};
+    }
+
+    receiver_entry->pipeline = gst_parse_launch(pipeline.c_str(), &error);
+    if (error != nullptr)
+    {
+      g_warning("Could not create fMP4 pipeline: %s\n", error->message);
+      g_error_free(error);
+      return {};
+    }
+
+    receiver_entry->fmp4_sink
+        = gst_bin_get_by_name(GST_BIN(receiver_entry->pipeline), "fmp4sink");
+    g_assert(receiver_entry->fmp4_sink != nullptr);
+
+    GstBus* bus;
+    bus = gst_pipeline_get_bus(GST_PIPELINE(receiver_entry->pipeline));
+    receiver_entry->bus_watch = gst_bus_add_watch(bus, bus_watch_cb, receiver_entry.get());
+    gst_bus_set_sync_handler(bus, bus_sync_cb, &self, nullptr);
+    gst_object_unref(bus);
+
+    if (gst_element_set_state(receiver_entry->pipeline, GST_STATE_PLAYING)
+        == GST_STATE_CHANGE_FAILURE)
+      g_warning("Could not start fMP4 pipeline");
+
+    return receiver_entry;
+  }
+
+  // Encoders of its own for the fMP4 muxer, only while no WebRTC viewer
+  // encodes its tracks at full quality. Fed like any other receiver.
+  static std::shared_ptr<ReceiverEntry> create_fmp4_encoder(Streamer& self)
+  {
+    auto receiver_entry = std::make_shared<ReceiverEntry>();
+    receiver_entry->self = &self;
+
+    std::string pipeline;
+    for (auto [source, generation] : self.fmp4_tracks)
+    {
+      const auto kind = self.sources[source]->kind;
+      if (kind == source_kind::video)
+        pipeline += video_encoder(self, source) + " ! h264parse ! " + encoded_tee(source);
+      else
+        pipeline += audio_encoder(source, self.conf.opus_frame_ms) + encoded_tee(source);
+
+      auto& track = *receiver_entry->tracks.emplace_back(std::make_unique<track_input>());
+      track.source = source;
+      track.generation = generation;
+      track.kind = kind;
+    }
+
+    GError* error = nullptr;
+    receiver_entry->pipeline = gst_parse_launch(pipeline.c_str(), &error);
+    if (error != nullptr)
+    {
+      g_warning("Could not create fMP4 encoder pipeline: %s\n", error->message);
+      g_error_free(error);
+      return {};
+    }
+
+    setup_sources(*receiver_entry, self);
+
+    GstBus* bus;
+    bus = gst_pipeline_get_bus(GST_PIPELINE(receiver_entry->pipeline));
+    receiver_entry->bus_watch = gst_bus_add_watch(bus, bus_watch_cb, receiver_entry.get());
+    gst_bus_set_sync_handler(bus, bus_sync_cb, &self, nullptr);
+    gst_object_unref(bus);
+
+    if (gst_element_set_state(receiver_entry->pipeline, GST_STATE_PLAYING)
+        == GST_STATE_CHANGE_FAILURE)
+      g_warning("Could not start fMP4 encoder pipeline");
+
+    return receiver_entry;
+  }
+
+  // The first video and audio tracks, with the registration they are from
+  std::vector<std::pair<int, uint32_t>> fmp4_sources() const
+  {
+    std::vector<std::pair<int, uint32_t>> selected;
+    bool has_video = false, has_audio = false;
+    for (int source : select_tracks({}))
+    {
+      const auto kind = sources[source]->kind;
+      if ((kind == source_kind::video && !std::exchange(has_video, true))
+          || (kind == source_kind::audio && !std::exchange(has_audio, true)))
+        selected.emplace_back(source, sources[source]->generation);
+    }
+    return selected;
+  }
+
+  std::vector<std::pair<int, uint32_t>> fmp4_current() const
+  {
+    return fmp4_tracks;
+  }
+
+  // A pipeline sending every fMP4 track, from the same registrations
+  bool encodes_fmp4_tracks(const ReceiverEntry& receiver_entry) const
+  {
+    if (!receiver_entry.pipeline)
+      return false;
+    return std::all_of(fmp4_tracks.begin(), fmp4_tracks.end(), [&](auto& wanted) {
+      return std::any_of(
+            receiver_entry.tracks.begin(), receiver_entry.tracks.end(), [&](auto& track) {
+              return track->source == wanted.first && track->generation == wanted.second;
+            });
+    });
+  }
+
+  std::shared_ptr<ReceiverEntry> find_fmp4_donor() const
+  {
+    for (auto& receiver : receivers)
+      if (is_webrtc_viewer(*receiver) && receiver->quality == rendition::full
+          && encodes_fmp4_tracks(*receiver))
+        return receiver;
+    return {};
+  }
+
+  // The muxer takes the encoded tracks from the tees of a WebRTC viewer
+  // sending them at full quality, the same until it leaves or changes, and
+  // encodes them itself only while there is none. Its inputs resume on a
+  // keyframe after each change; encoders with the same settings give the
+  // same stream headers, which the muxer requires.
+  void update_fmp4_input()
+  {
+    auto donor = fmp4_donor.lock();
+    if (donor && donor->pipeline == fmp4_donor_pipeline)
+    {
+      const bool keep = donor == fmp4_encoder
+                            ? !find_fmp4_donor()
+                            : donor->quality == rendition::full && encodes_fmp4_tracks(*donor);
+      if (keep)
+        return;
+      detach_fmp4_taps(*donor);
+    }
+
+    auto next = find_fmp4_donor();
+    if (!next)
+    {
+      if (!fmp4_encoder)
+      {
+        fmp4_encoder = create_fmp4_encoder(*this);
+        if (!fmp4_encoder)
+        {
+          close_fmp4_clients();
+          return;
+        }
+        receivers.push_back(fmp4_encoder);
+        g_hash_table_replace(receiver_entry_table, fmp4_encoder.get(), fmp4_encoder.get());
+      }
+      next = fmp4_encoder;
+    }
+
+    attach_fmp4_taps(*next);
+    fmp4_donor = next;
+    fmp4_donor_pipeline = next->pipeline;
+    if (fmp4_encoder && next != fmp4_encoder)
+    {
+      remove_receiver(*this, fmp4_encoder.get());
+      fmp4_encoder.reset();
+    }
+  }
+
+  void attach_fmp4_taps(ReceiverEntry& donor)
+  {
+    {
+      std::lock_guard lock{fmp4_time->mutex};
+      fmp4_time->mapped = false;
+    }
+    auto bin = GST_BIN(fmp4->pipeline);
+    for (auto& track : donor.tracks)
+    {
+      const auto name = "fmp4src_" + std::to_string(track->source);
+      if (GstElement* appsrc = gst_bin_get_by_name(bin, name.c_str()))
+      {
+        attach_fmp4_tap(donor, *track, appsrc, fmp4_time);
+        gst_object_unref(appsrc);
+      }
+    }
+  }
+
+  void detach_fmp4_taps(ReceiverEntry& donor)
+  {
+    for (auto& track : donor.tracks)
+      detach_fmp4_tap(*track);
+  }
+
+  // The donor timestamps, shifted by one offset for all its tracks so that
+  // they stay in sync and keep their durations. It is set by the first
+  // buffer after each change of donor: that one lands at the current running
+  // time of the muxer, and after anything already sent.
+  struct fmp4_timeline
+  {
+    std::mutex mutex;
+    bool mapped{};
+    GstClockTimeDiff offset{};
+    // Last timestamp sent of the audio and video track
+    GstClockTime last[2]{GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE};
+  };
+
+  // Runs in the tap streaming thread. A buffer copy shares the memory.
+  struct fmp4_tap
+  {
+    GstElement* appsrc;
+    std::shared_ptr<fmp4_timeline> timeline;
+    bool video;
+    bool started;
+  };
+
+  // The offset from the donor time ts to the muxer timeline, false for a
+  // buffer to drop: no clock yet, or older than what the track already sent
+  static bool fmp4_rebase(fmp4_tap& tap, GstClockTime ts, GstClockTimeDiff& offset)
+  {
+    auto& timeline = *tap.timeline;
+    std::lock_guard lock{timeline.mutex};
+    if (!timeline.mapped)
+    {
+      GstClock* clock = gst_element_get_clock(tap.appsrc);
+      if (!clock)
+        return false;
+      GstClockTime start
+          = gst_clock_get_time(clock) - gst_element_get_base_time(tap.appsrc);
+      gst_object_unref(clock);
+      for (GstClockTime last : timeline.last)
+        if (GST_CLOCK_TIME_IS_VALID(last))
+          start = std::max(start, last + GST_MSECOND);
+      timeline.offset = GstClockTimeDiff(start) - GstClockTimeDiff(ts);
+      timeline.mapped = true;
+    }
+
+    const GstClockTimeDiff rebased = GstClockTimeDiff(ts) + timeline.offset;
+    GstClockTime& last = timeline.last[tap.video];
+    if (rebased < 0 || (GST_CLOCK_TIME_IS_VALID(last) && GstClockTime(rebased) <= last))
+      return false;
+    last = rebased;
+    offset = timeline.offset;
+    return true;
+  }
+
+  static GstFlowReturn fmp4_tap_cb(GstAppSink* sink, gpointer user_data)
+  {
+    auto& tap = *(fmp4_tap*)user_data;
+    GstSample* sample = gst_app_sink_pull_sample(sink);
+    if (!sample)
+      return GST_FLOW_FLUSHING;
+
+    GstBuffer* buffer = gst_sample_get_buffer(sample);
+    if (!tap.started && tap.video && GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    {
+      gst_sample_unref(sample);
+      return GST_FLOW_OK;
+    }
+    const GstClockTime ts = GST_BUFFER_DTS_OR_PTS(buffer);
+    GstClockTimeDiff offset{};
+    if (!GST_CLOCK_TIME_IS_VALID(ts) || !fmp4_rebase(tap, ts, offset))
+    {
+      gst_sample_unref(sample);
+      return GST_FLOW_OK;
+    }
+    if (!tap.started)
+    {
+      gst_app_src_set_caps(GST_APP_SRC(tap.appsrc), gst_sample_get_caps(sample));
+      tap.started = true;
+    }
 
-    ice_json = json_object_new();
-    json_object_set_string_member(ice_json, "type", "ice");
+    buffer = gst_buffer_copy(buffer);
+    if (GST_BUFFER_PTS_IS_VALID(buffer))
+      GST_BUFFER_PTS(buffer) += offset;
+    if (GST_BUFFER_DTS_IS_VALID(buffer))
+      GST_BUFFER_DTS(buffer) += offset;
+    gst_sample_unref(sample);
+    gst_app_src_push_buffer(GST_APP_SRC(tap.appsrc), buffer);
+    return GST_FLOW_OK;
+  }
 
-    ice_data_json = json_object_new();
-    json_object_set_int_member(ice_data_json, "sdpMLineIndex", mline_index);
-    json_object_set_string_member(ice_data_json, "candidate", candidate);
-    json_object_set_object_member(ice_json, "data", ice_data_json);
+  // A new branch on the track's tee: a leaky queue, so that the muxer
+  // never holds the viewer back, and an appsink feeding the fMP4 input.
+  static void attach_fmp4_tap(
+      ReceiverEntry& donor,
+      track_input& track,
+      GstElement* appsrc,
+      std::shared_ptr<fmp4_timeline> timeline)
+  {
+    if (track.tap_pad)
+      return;
+    GstElement* tee = gst_bin_get_by_name(
+          GST_BIN(donor.pipeline), ("encoded_" + std::to_string(track.source)).c_str());
+    if (!tee)
+      return;
+    // Next to it: the branch may be a bin of its own
+    auto bin = GST_BIN(GST_ELEMENT_PARENT(tee));
+
+    GstElement* queue = gst_element_factory_make("queue", nullptr);
+    g_object_set(
+          queue,
+          "leaky", 2,
+          "max-size-buffers", 64,
+          "max-size-bytes", 0,
+          "max-size-time", (guint64)0,
+          nullptr);
+    GstElement* sink = gst_element_factory_make("appsink", nullptr);
+    g_object_set(sink, "sync", FALSE, "async", FALSE, nullptr);
+    GstAppSinkCallbacks callbacks{};
+    callbacks.new_sample = fmp4_tap_cb;
+    gst_app_sink_set_callbacks(
+          GST_APP_SINK(sink),
+          &callbacks,
+          new fmp4_tap{
+              (GstElement*)gst_object_ref(appsrc),
+              std::move(timeline),
+              track.kind == source_kind::video,
+              false},
+          [](gpointer p) {
+            auto tap = (fmp4_tap*)p;
+            gst_object_unref(tap->appsrc);
+            delete tap;
+          });
+
+    gst_bin_add_many(bin, queue, sink, nullptr);
+    gst_element_link(queue, sink);
+    track.tap_pad = gst_element_request_pad_simple(tee, "src_%u");
+    GstPad* queue_sink = gst_element_get_static_pad(queue, "sink");
+    gst_pad_link(track.tap_pad, queue_sink);
+    gst_object_unref(queue_sink);
+    gst_element_sync_state_with_parent(sink);
+    gst_element_sync_state_with_parent(queue);
+    gst_object_unref(tee);
+
+    // The muxer input starts on a keyframe: no waiting for the next one
+    if (track.kind == source_kind::video)
+      gst_pad_send_event(
+            track.tap_pad,
+            gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+
+    track.tap_queue = queue;
+    track.tap_sink = sink;
+  }
 
-    json_string = get_string_from_json_object(ice_json);
+  // Stopped first: the tee then sees a flushing pad, which it skips
+  static void detach_fmp4_tap(track_input& track)
+  {
+    if (!track.tap_pad)
+      return;
 
-    // std::cerr << "on_ice_candidate_cb: JSON OUTPUT: '" << json_string << "'\n";
-    json_object_unref(ice_json);
+    gst_element_set_state(track.tap_queue, GST_STATE_NULL);
+    gst_element_set_state(track.tap_sink, GST_STATE_NULL);
+    if (GstElement* tee = gst_pad_get_parent_element(track.tap_pad))
+    {
+      gst_element_release_request_pad(tee, track.tap_pad);
+      gst_object_unref(tee);
+    }
+    gst_object_unref(std::exchange(track.tap_pad, nullptr));
+    auto bin = GST_BIN(GST_ELEMENT_PARENT(track.tap_queue));
+    gst_bin_remove_many(
+          bin,
+          std::exchange(track.tap_queue, nullptr),
+          std::exchange(track.tap_sink, nullptr),
+          nullptr);
+  }
 
-    soup_websocket_connection_send_text(
-          receiver_entry->connection, json_string);
-    g_free(json_string);
+  void close_fmp4_clients()
+  {
+    for (auto& client : fmp4_clients)
+      if (soup_websocket_connection_get_state(client.connection) == SOUP_WEBSOCKET_STATE_OPEN)
+        soup_websocket_connection_close(
+              client.connection, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, nullptr);
   }
 
-  static void soup_websocket_message_cb(
-      G_GNUC_UNUSED SoupWebsocketConnection* connection,
-      SoupWebsocketDataType data_type,
-      GBytes* message,
+  static void soup_fmp4_closed_cb(
+      SoupWebsocketConnection* connection,
       gpointer user_data)
   {
-    gsize size;
-    gchar* data;
-    gchar* data_string;
-    const gchar* type_string;
-    JsonNode* root_json;
-    JsonObject* root_json_object;
-    JsonObject* data_json_object;
-    JsonParser* json_parser = nullptr;
-    ReceiverEntry* receiver_entry = (ReceiverEntry*)user_data;
+    Streamer& self = *(Streamer*)user_data;
 
-    switch (data_type)
+    for (auto it = self.fmp4_clients.begin(); it != self.fmp4_clients.end(); ++it)
     {
-    case SOUP_WEBSOCKET_DATA_BINARY:
-      g_error("Received unknown binary message, ignoring\n");
-      g_bytes_unref(message);
-      return;
+      if (it->connection == connection)
+      {
+        g_object_unref(G_OBJECT(connection));
+        if (it->socket)
+          g_object_unref(it->socket);
+        self.fmp4_clients.erase(it);
+        break;
+      }
+    }
 
-    case SOUP_WEBSOCKET_DATA_TEXT:
-      data = (gchar*)g_bytes_unref_to_data(message, &size);
-      /* Convert to nullptr-terminated string */
-      data_string = g_strndup(data, size);
-      g_free(data);
-      break;
+    if (self.fmp4_clients.empty() && self.fmp4)
+    {
+      auto donor = self.fmp4_donor.lock();
+      if (donor && donor->pipeline == self.fmp4_donor_pipeline)
+        self.detach_fmp4_taps(*donor);
+      self.fmp4_donor.reset();
+      self.fmp4_donor_pipeline = nullptr;
+      if (self.fmp4_encoder)
+      {
+        remove_receiver(self, self.fmp4_encoder.get());
+        self.fmp4_encoder.reset();
+      }
 
-    default:
-      g_assert_not_reached();
+      remove_receiver(self, self.fmp4.get());
+      self.fmp4.reset();
+      self.fmp4_tracks.clear();
+      self.fmp4_header.clear();
+      self.fmp4_header_done = false;
+      self.fmp4_video_track = 0;
+      self.fmp4_time.reset();
     }
+  }
 
-    json_parser = json_parser_new();
-    if (!json_parser_load_from_data(json_parser, data_string, -1, nullptr))
-      goto unknown_message;
+  static void soup_fmp4_handler(
+      G_GNUC_UNUSED SoupServer* server,
+      SoupWebsocketConnection* connection,
+      G_GNUC_UNUSED const char* path,
+      SoupClientContext* client_context,
+      gpointer user_data)
+  {
+    Streamer& self = *(Streamer*)user_data;
 
-    root_json = json_parser_get_root(json_parser);
-    if (!JSON_NODE_HOLDS_OBJECT(root_json))
-      goto unknown_message;
+    gst_print("Processing new fMP4 connection %p", (gpointer)connection);
 
-    root_json_object = json_node_get_object(root_json);
+    g_object_ref(G_OBJECT(connection));
+    g_signal_connect(
+          G_OBJECT(connection),
+          "closed",
+          G_CALLBACK(soup_fmp4_closed_cb),
+          &self);
 
-    if (!json_object_has_member(root_json_object, "type"))
+    // Its send buffer is what the viewer may fall behind by, see pump_fmp4
+    GSocket* socket = soup_client_context_get_gsocket(client_context);
+    if (socket)
     {
-      g_error("Received message without type field\n");
-      goto cleanup;
+      g_object_ref(socket);
+      g_socket_set_option(
+            socket, SOL_SOCKET, SO_SNDBUF, self.conf.fmp4_max_queued_bytes, nullptr);
     }
-    type_string = json_object_get_string_member(root_json_object, "type");
+    self.fmp4_clients.push_back({.connection = connection, .socket = socket});
 
-    if (!json_object_has_member(root_json_object, "data"))
+    if (!self.fmp4)
     {
-      g_error("Received message without data field\n");
-      goto cleanup;
+      self.fmp4 = create_fmp4_entry(self);
+      if (!self.fmp4)
+        return;
+
+      self.receivers.push_back(self.fmp4);
+      g_hash_table_replace(
+            self.receiver_entry_table, self.fmp4.get(), self.fmp4.get());
     }
-    data_json_object = json_object_get_object_member(root_json_object, "data");
+  }
 
-    if (g_strcmp0(type_string, "sdp") == 0)
+  //// ISO BMFF, enough to find where fMP4 viewers can join
+
+  // Calls f(type, payload, size) for each box in data
+  template <typename F>
+  static void mp4_boxes(const guint8* data, std::size_t size, F&& f)
+  {
+    while (size >= 8)
     {
-      const gchar* sdp_type_string;
-      const gchar* sdp_string;
-      GstPromise* promise;
-      GstSDPMessage* sdp;
-      GstWebRTCSessionDescription* answer;
-      int ret;
+      std::size_t box = GST_READ_UINT32_BE(data);
+      if (box == 0)
+        box = size;
+      if (box < 8 || box > size)
+        return;
+      f((const char*)data + 4, data + 8, box - 8);
+      data += box;
+      size -= box;
+    }
+  }
 
-      if (!json_object_has_member(data_json_object, "type"))
-      {
-        g_error("Received SDP message without type field\n");
-        goto cleanup;
-      }
-      sdp_type_string
-          = json_object_get_string_member(data_json_object, "type");
+  // Track ID of the video trak in the init segment, 0 if none
+  static guint32 mp4_video_track(const guint8* data, std::size_t size)
+  {
+    guint32 video_track = 0;
+    mp4_boxes(data, size, [&](const char* type, const guint8* moov, std::size_t moov_size) {
+      if (memcmp(type, "moov", 4) != 0)
+        return;
+      mp4_boxes(moov, moov_size, [&](const char* type, const guint8* trak, std::size_t trak_size) {
+        if (memcmp(type, "trak", 4) != 0)
+          return;
+        guint32 id = 0;
+        bool video = false;
+        mp4_boxes(trak, trak_size, [&](const char* type, const guint8* box, std::size_t box_size) {
+          // tkhd: version 1 has 64-bit times before the ID
+          if (memcmp(type, "tkhd", 4) == 0 && box_size >= 24)
+            id = GST_READ_UINT32_BE(box + (box[0] == 1 ? 20 : 12));
+          else if (memcmp(type, "mdia", 4) == 0)
+            mp4_boxes(box, box_size, [&](const char* type, const guint8* hdlr, std::size_t hdlr_size) {
+              if (memcmp(type, "hdlr", 4) == 0 && hdlr_size >= 12
+                  && memcmp(hdlr + 8, "vide", 4) == 0)
+                video = true;
+            });
+        });
+        if (video)
+          video_track = id;
+      });
+    });
+    return video_track;
+  }
 
-      if (g_strcmp0(sdp_type_string, "answer") != 0)
-      {
-        g_error(
-              "Expected SDP message type \"answer\", got \"%s\"\n",
-              sdp_type_string);
-        goto cleanup;
-      }
+  // Whether the run of a track in a fragment starts on a sync sample, from
+  // the sample flags in trun, else the default ones in tfhd
+  static bool mp4_sync_fragment(const guint8* data, std::size_t size, guint32 track)
+  {
+    static constexpr guint32 non_sync_sample = 0x10000;
+    bool sync = false;
+    mp4_boxes(data, size, [&](const char* type, const guint8* moof, std::size_t moof_size) {
+      if (memcmp(type, "moof", 4) != 0)
+        return;
+      mp4_boxes(moof, moof_size, [&](const char* type, const guint8* traf, std::size_t traf_size) {
+        if (memcmp(type, "traf", 4) != 0)
+          return;
+        guint32 id = 0, sample_flags = 0;
+        mp4_boxes(traf, traf_size, [&](const char* type, const guint8* box, std::size_t box_size) {
+          if (box_size < 8)
+            return;
+          const guint32 flags = GST_READ_UINT32_BE(box) & 0xffffff;
+          if (memcmp(type, "tfhd", 4) == 0)
+          {
+            id = GST_READ_UINT32_BE(box + 4);
+            std::size_t at = 8 + (flags & 0x01 ? 8 : 0) + (flags & 0x02 ? 4 : 0)
+                             + (flags & 0x08 ? 4 : 0) + (flags & 0x10 ? 4 : 0);
+            if ((flags & 0x20) && box_size >= at + 4)
+              sample_flags = GST_READ_UINT32_BE(box + at);
+          }
+          else if (memcmp(type, "trun", 4) == 0 && id == track && GST_READ_UINT32_BE(box + 4) > 0)
+          {
+            // first_sample_flags, else the flags of the first sample
+            std::size_t at = 8 + (flags & 0x01 ? 4 : 0);
+            if (!(flags & 0x04))
+              at += (flags & 0x100 ? 4 : 0) + (flags & 0x200 ? 4 : 0);
+            if ((flags & 0x404) && box_size >= at + 4)
+              sample_flags = GST_READ_UINT32_BE(box + at);
+            sync = !(sample_flags & non_sync_sample);
+          }
+        });
+      });
+    });
+    return sync;
+  }
 
-      if (!json_object_has_member(data_json_object, "sdp"))
-      {
-        g_error("Received SDP message without SDP string\n");
-        goto cleanup;
-      }
-      sdp_string = json_object_get_string_member(data_json_object, "sdp");
+  //// Local output
 
-      gst_print("Received SDP:\n%s\n", sdp_string);
+  // Consumers on this machine read the tracks from shmsink sockets, raw or
+  // encoded, without DTLS/SRTP nor RTP. One pipeline per track, so that a
+  // track coming or going leaves the consumers of the others connected.
+  std::string local_socket_path(int source) const
+  {
+    std::string name = sources[source]->name;
+    for (char& c : name)
+      if (!g_ascii_isalnum(c))
+        c = '_';
+    return conf.local_path + "/" + std::to_string(source) + "-" + name;
+  }
 
-      ret = gst_sdp_message_new(&sdp);
-      g_assert_cmphex(ret, ==, GST_SDP_OK);
+  static std::shared_ptr<ReceiverEntry> create_local_output(Streamer& self, int source)
+  {
+    auto receiver_entry = std::make_shared<ReceiverEntry>();
+    receiver_entry->self = &self;
+    receiver_entry->local_socket = self.local_socket_path(source);
+
+    const auto id = std::to_string(source);
+    const auto kind = self.sources[source]->kind;
+    std::string pipeline;
+    if (kind == source_kind::video)
+      pipeline = self.conf.local_encoded
+                     ? video_encoder(self, source)
+                           + " ! h264parse "
+                             " ! video/x-h264,stream-format=byte-stream,alignment=au ! "
+                     : " appsrc is-live=1 name=myvid_" + id + " leaky-type=2 min-latency=0 ! ";
+    else
+      pipeline = self.conf.local_encoded
+                     ? audio_encoder(source, self.conf.opus_frame_ms)
+                     : " appsrc is-live=1 name=mysound_" + id + " leaky-type=2 min-latency=0 ! ";
+    pipeline += "shmsink name=localsink_" + id + " socket-path=\"" + receiver_entry->local_socket
+                + "\" wait-for-connection=false sync=false async=false ";
 
-      ret = gst_sdp_message_parse_buffer(
-              (guint8*)sdp_string, strlen(sdp_string), sdp);
-      if (ret != GST_SDP_OK)
-      {
-        g_error("Could not parse SDP string\n");
-        goto cleanup;
-      }
+    auto& track = *receiver_entry->tracks.emplace_back(std::make_unique<track_input>());
+    track.source = source;
+    track.generation = self.sources[source]->generation;
+    track.kind = kind;
 
-      answer = gst_webrtc_session_description_new(
-                 GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
-      g_assert_nonnull(answer);
+    // Left behind by a run that did not stop cleanly, shmsink would fail
+    g_mkdir_with_parents(self.conf.local_path.c_str(), 0700);
+    g_unlink(receiver_entry->local_socket.c_str());
 
-      promise = gst_promise_new();
-      g_signal_emit_by_name(
-            receiver_entry->webrtcbin,
-            "set-remote-description",
-            answer,
-            promise);
-      gst_promise_interrupt(promise);
-      gst_promise_unref(promise);
-      gst_webrtc_session_description_free(answer);
-    }
-    else if (g_strcmp0(type_string, "ice") == 0)
+    GError* error = nullptr;
+    receiver_entry->pipeline = gst_parse_launch(pipeline.c_str(), &error);
+    if (error != nullptr)
     {
-      guint mline_index;
-      const gchar* candidate_string;
-
-      if (!json_object_has_member(data_json_object, "sdpMLineIndex"))
-      {
-        g_error("Received ICE message without mline index\n");
-        goto cleanup;
-      }
-      mline_index
-          = json_object_get_int_member(data_json_object, "sdpMLineIndex");
-
-      if (!json_object_has_member(data_json_object, "candidate"))
-      {
-        g_error("Received ICE message without ICE candidate string\n");
-        goto cleanup;
-      }
-      candidate_string
-          = json_object_get_string_member(data_json_object, "candidate");
+      g_warning("Could not create local output pipeline: %s\n", error->message);
+      g_error_free(error);
+      return {};
+    }
 
-      gst_print(
-            "Received ICE candidate with mline index %u; candidate: %s\n",
-            mline_index,
-            candidate_string);
+    setup_sources(*receiver_entry, self);
 
-      g_signal_emit_by_name(
-            receiver_entry->webrtcbin,
-            "add-ice-candidate",
-            mline_index,
-            candidate_string);
-    }
-    else
-      goto unknown_message;
+    GstBus* bus;
+    bus = gst_pipeline_get_bus(GST_PIPELINE(receiver_entry->pipeline));
+    receiver_entry->bus_watch = gst_bus_add_watch(bus, bus_watch_cb, receiver_entry.get());
+    gst_bus_set_sync_handler(bus, bus_sync_cb, &self, nullptr);
+    gst_object_unref(bus);
 
-cleanup:
-    if (json_parser != nullptr)
-      g_object_unref(G_OBJECT(json_parser));
-    g_free(data_string);
-    return;
+    if (gst_element_set_state(receiver_entry->pipeline, GST_STATE_PLAYING)
+        == GST_STATE_CHANGE_FAILURE)
+      g_warning("Could not start local output pipeline");
 
-unknown_message:
-    g_error("Unknown message \"%s\", ignoring", data_string);
-    goto cleanup;
+    return receiver_entry;
   }
 
-  static void soup_websocket_closed_cb(
-      SoupWebsocketConnection* connection,
-      gpointer user_data)
+  // Follows the registrations: published_tracks is up to date
+  void update_local_outputs()
   {
-    Streamer& self = *(Streamer*)user_data;
+    if (conf.local_path.empty())
+      return;
 
-    for(auto it = self.receivers.begin(); it != self.receivers.end(); ) {
-      if((*it)->connection == connection) {
-        it = self.receivers.erase(it);
-        break;
-      } else {
+    for (auto it = local_outputs.begin(); it != local_outputs.end();)
+    {
+      auto& track = *(*it)->tracks.front();
+      if (published_tracks[track.source] == track.generation)
+      {
         ++it;
+        continue;
       }
+      remove_receiver(*this, it->get());
+      it = local_outputs.erase(it);
     }
-    GHashTable* receiver_entry_table = self.receiver_entry_table;
-    g_hash_table_remove(receiver_entry_table, connection);
 
+    for (int source = 0; source < max_sources; source++)
+    {
+      if (published_tracks[source] == 0
+          || std::any_of(local_outputs.begin(), local_outputs.end(), [source](auto& output) {
+               return output->tracks.front()->source == source;
+             }))
+        continue;
+
+      if (auto output = create_local_output(*this, source))
+      {
+        local_outputs.push_back(output);
+        receivers.push_back(output);
+        g_hash_table_replace(receiver_entry_table, output.get(), output.get());
+      }
+    }
   }
-  static void soup_http_handler(
+
+  // What consumers pass to shmsrc: socket-path, and the caps to set on it
+  static void soup_local_handler(
       G_GNUC_UNUSED SoupServer* soup_server,
       SoupMessage* message,
-      const char* path,
+      G_GNUC_UNUSED const char* path,
       G_GNUC_UNUSED GHashTable* query,
       G_GNUC_UNUSED SoupClientContext* client_context,
-      G_GNUC_UNUSED gpointer user_data)
+      gpointer user_data)
   {
-    SoupBuffer* soup_buffer;
-
-    if ((g_strcmp0(path, "/") != 0) && (g_strcmp0(path, "/index.html") != 0))
+    Streamer& self = *(Streamer*)user_data;
+    if (self.conf.local_path.empty())
     {
       soup_message_set_status(message, SOUP_STATUS_NOT_FOUND);
       return;
     }
 
-    static boost::iostreams::mapped_file mmap(
-          "webrtc.html",
-          boost::iostreams::mapped_file::readonly);
-    soup_buffer
-        = soup_buffer_new(SOUP_MEMORY_STATIC, mmap.const_data(), mmap.size());
+    JsonArray* tracks = json_array_new();
+    for (auto& output : self.local_outputs)
+    {
+      const auto& track = *output->tracks.front();
+      JsonObject* track_json = json_object_new();
+      json_object_set_string_member(
+            track_json, "name", self.sources[track.source]->name.c_str());
+      json_object_set_string_member(track_json, "kind", kind_name(track.kind));
+      json_object_set_string_member(track_json, "socket", output->local_socket.c_str());
+      json_object_set_boolean_member(track_json, "encoded", self.conf.local_encoded);
+
+      // Known once the first buffer went through
+      GstElement* sink = gst_bin_get_by_name(
+            GST_BIN(output->pipeline), ("localsink_" + std::to_string(track.source)).c_str());
+      GstPad* pad = gst_element_get_static_pad(sink, "sink");
+      if (GstCaps* caps = gst_pad_get_current_caps(pad))
+      {
+        gchar* caps_string = gst_caps_to_string(caps);
+        json_object_set_string_member(track_json, "caps", caps_string);
+        g_free(caps_string);
+        gst_caps_unref(caps);
+      }
+      gst_object_unref(pad);
+      gst_object_unref(sink);
 
-    soup_message_headers_set_content_type(
-          message->response_headers, "text/html", nullptr);
-    soup_message_body_append_buffer(message->response_body, soup_buffer);
-    soup_buffer_free(soup_buffer);
+      json_array_add_object_element(tracks, track_json);
+    }
 
+    JsonObject* local_json = json_object_new();
+    json_object_set_array_member(local_json, "tracks", tracks);
+    gchar* json_string = get_string_from_json_object(local_json);
+    json_object_unref(local_json);
+
+    soup_message_set_response(
+          message, "application/json", SOUP_MEMORY_TAKE, json_string, strlen(json_string));
     soup_message_set_status(message, SOUP_STATUS_OK);
   }
 
-  static void soup_websocket_handler(
-      G_GNUC_UNUSED SoupServer* server,
-      SoupWebsocketConnection* connection,
-      G_GNUC_UNUSED const char* path,
-      G_GNUC_UNUSED SoupClientContext* client_context,
-      gpointer user_data)
+
+  // Bytes a viewer has not acknowledged yet, -1 if unknown
+  static int fmp4_backlog(const fmp4_client& client)
   {
-    Streamer& self = *(Streamer*)user_data;
-    GHashTable* receiver_entry_table = self.receiver_entry_table;
+#if defined(__linux__)
+    int queued = 0;
+    if (client.socket && ioctl(g_socket_get_fd(client.socket), SIOCOUTQ, &queued) == 0)
+      return queued;
+#endif
+    return -1;
+  }
 
-    gst_print("Processing new websocket connection %p", (gpointer)connection);
+  // Forwards the muxer output to the viewers. Everything before the first
+  // moof is the init segment (ftyp + moov), which new viewers get first;
+  // they then join at the next fragment starting on a keyframe. A viewer
+  // more than fmp4_max_queued_bytes behind stops getting fragments until it
+  // caught up, and is dropped when it does not within a few seconds.
+  void pump_fmp4()
+  {
+    if (!fmp4)
+      return;
+    update_fmp4_input();
+    if (!fmp4)
+      return;
 
-    g_signal_connect(
-          G_OBJECT(connection),
-          "closed",
-          G_CALLBACK(soup_websocket_closed_cb),
-          &self);
+    static constexpr gint64 max_stall_us = 5 * G_USEC_PER_SEC;
+    std::vector<SoupWebsocketConnection*> stalled;
+    while (GstSample* sample = gst_app_sink_try_pull_sample(
+               GST_APP_SINK(fmp4->fmp4_sink), 0))
+    {
+      GstBuffer* buffer = gst_sample_get_buffer(sample);
+      GstMapInfo map{};
+      gst_buffer_map(buffer, &map, GST_MAP_READ);
+
+      const bool moof = map.size >= 8 && memcmp(map.data + 4, "moof", 4) == 0;
+      if (!fmp4_header_done && !moof)
+      {
+        fmp4_header.insert(fmp4_header.end(), map.data, map.data + map.size);
+      }
+      else
+      {
+        if (!fmp4_header_done)
+          fmp4_video_track = mp4_video_track(fmp4_header.data(), fmp4_header.size());
+        fmp4_header_done = true;
+
+        const bool join = moof
+                          && (fmp4_video_track == 0
+                              || mp4_sync_fragment(map.data, map.size, fmp4_video_track));
+        const gint64 now = g_get_monotonic_time();
+        for (auto& client : fmp4_clients)
+        {
+          if (soup_websocket_connection_get_state(client.connection)
+              != SOUP_WEBSOCKET_STATE_OPEN)
+            continue;
+
+          // Decided once per fragment, for all its buffers
+          if (moof)
+          {
+            if (fmp4_backlog(client) > conf.fmp4_max_queued_bytes)
+            {
+              client.synced = false;
+              if (client.stalled_since == 0)
+                client.stalled_since = now;
+              else if (now - client.stalled_since > max_stall_us)
+                stalled.push_back(client.connection);
+            }
+            else if (!client.synced && join)
+            {
+              client.synced = true;
+              client.stalled_since = 0;
+              if (!client.header_sent)
+                soup_websocket_connection_send_binary(
+                      client.connection, fmp4_header.data(), fmp4_header.size());
+              client.header_sent = true;
+            }
+          }
 
-    auto receiver_entry = create_receiver_entry(connection, self);
-    self.receivers.push_back(receiver_entry);
-    g_hash_table_replace(receiver_entry_table, connection, receiver_entry.get());
+          if (client.synced)
+            soup_websocket_connection_send_binary(
+                  client.connection, map.data, map.size);
+        }
+      }
+
+      gst_buffer_unmap(buffer, &map);
+      gst_sample_unref(sample);
+    }
+
+    for (auto connection : stalled)
+    {
+      g_warning("fMP4 viewer %p too far behind, closing", (gpointer)connection);
+      soup_websocket_connection_close(connection, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, nullptr);
+    }
   }
 
   static gchar* get_string_from_json_object(JsonObject* object)
@@ -797,6 +5152,9 @@ unknown_message:
   {
     GError* error = nullptr;
 
+    if (conf.streamer_thread.enabled())
+      apply_thread_settings(conf.streamer_thread);
+
     setlocale(LC_ALL, "C");
     receiver_entry_table = g_hash_table_new_full(
                              g_direct_hash, g_direct_equal, nullptr, destroy_receiver_entry);
@@ -807,7 +5165,21 @@ unknown_message:
     soup_server = soup_server_new(
                     SOUP_SERVER_SERVER_HEADER, "webrtc-soup-server", nullptr);
     soup_server_add_handler(
-          soup_server, "/", soup_http_handler, nullptr, nullptr);
+          soup_server, "/", soup_http_handler, (gpointer)this, nullptr);
+    soup_server_add_handler(
+          soup_server, "/whep", soup_whep_handler, (gpointer)this, nullptr);
+    soup_server_add_handler(
+          soup_server, "/stats", soup_stats_handler, (gpointer)this, nullptr);
+    soup_server_add_handler(
+          soup_server, "/load", soup_load_handler, (gpointer)this, nullptr);
+    soup_server_add_handler(
+          soup_server, "/local", soup_local_handler, (gpointer)this, nullptr);
+    soup_server_add_early_handler(
+          soup_server, "/ws", soup_admission_handler, (gpointer)this, nullptr);
+#if defined(WITCHBRIDGE_TRACING)
+    soup_server_add_handler(
+          soup_server, "/trace", soup_trace_handler, (gpointer)this, nullptr);
+#endif
     soup_server_add_websocket_handler(
           soup_server,
           "/ws",
@@ -816,17 +5188,39 @@ unknown_message:
           soup_websocket_handler,
           (gpointer)this,
           nullptr);
+    soup_server_add_websocket_handler(
+          soup_server,
+          "/fmp4",
+          nullptr,
+          nullptr,
+          soup_fmp4_handler,
+          (gpointer)this,
+          nullptr);
     soup_server_listen_all(
           soup_server, SOUP_HTTP_PORT, (SoupServerListenOptions)0, nullptr);
 
     gst_print(
           "WebRTC page link: http://127.0.0.1:%d/\n", (gint)SOUP_HTTP_PORT);
+    if (!conf.local_path.empty())
+      gst_print(
+            "Local output in %s, listed on http://127.0.0.1:%d/local\n",
+            conf.local_path.c_str(), (gint)SOUP_HTTP_PORT);
 
     g_timeout_add(1, (GSourceFunc) +[] (void* data) {
       ((Streamer*)(data))->buffer_read_timeout(); }, this);
+    g_timeout_add(1000, (GSourceFunc) +[] (void* data) {
+      return (gboolean)((Streamer*)(data))->update_load(); }, this);
+    if (conf.receive)
+      g_timeout_add(500, (GSourceFunc) +[] (void* data) {
+        return (gboolean)((Streamer*)(data))->adapt_jitterbuffers(); }, this);
 
     g_main_loop_run(mainloop);
 
+#if defined(WITCHBRIDGE_TRACING)
+    if (tracer.enabled)
+      tracer.write(conf.trace_path);
+#endif
+    quitting = true;
     g_object_unref(G_OBJECT(soup_server));
     g_hash_table_destroy(receiver_entry_table);
     g_main_loop_unref(mainloop);
@@ -835,64 +5229,452 @@ unknown_message:
   bool buffer_read_timeout()
   {
     ready = true;
-    int kmax = 20;
-    while(audio_buffer* p = audio_to_send.front())
+    if (shm)
+      mirror_shared_sources();
+
+    bool tracks_changed = false;
+    for (int i = 0; i < max_sources; i++)
     {
-      for(auto& receiver : receivers) {
-        // Don't buffer on receivers that haven't even started polling
+      auto& src = *sources[i];
+      const int state = src.state.load(std::memory_order_acquire);
+      source_states[i] = state;
 
-        receiver->push_data_audio(*p);
-/*
-        {
-          for(int f = 0; f < p->frames; f++) {
-            audio_frame frame;
-            for(int c = 0; c < p->channels; c++) {
-              frame.sample[c] = p->audio[c][f];
-            }
+      // Registrations are numbered: any change means another set of tracks
+      const uint32_t published = state == Source::active ? src.generation : 0;
+      if (published != published_tracks[i])
+      {
+        published_tracks[i] = published;
+        tracks_changed = true;
+      }
+    }
 
-            receiver->buf.push_back(frame);
-          }
-        }*/
+    // Audio is due every encoder frame: it goes first, and again after
+    // each video frame. Video gets the time budget, round robin so that
+    // the same sources are not always the ones left for the next round,
+    // where only their latest frame is sent.
+    drain_all_audio();
+    const gint64 deadline = g_get_monotonic_time() + conf.video_budget_us;
+    int next = (next_video_source + 1) % max_sources;
+    for (int n = 0; n < max_sources; n++)
+    {
+      const int i = (next_video_source + n) % max_sources;
+      auto& src = *sources[i];
+      if (!draining(source_states[i]) || src.kind != source_kind::video)
+        continue;
+      if (g_get_monotonic_time() >= deadline)
+      {
+        next = i;
+        stats.video_deferred++;
+        break;
       }
 
-      audio_to_free.push(*p);
-      audio_to_send.pop();
+      if (shm)
+        drain_shared(src, shm->sources[i], i);
+      else
+        drain_video(src, i);
+      drain_all_audio();
+    }
+    next_video_source = next;
 
-      if(kmax-- < 0)
-        break;
+    for (int i = 0; i < max_sources; i++)
+      if (source_states[i] == Source::closing)
+        sources[i]->release();
+
+    if (tracks_changed)
+      update_tracks();
+
+    pump_fmp4();
+    return true;
+  }
+
+  static bool draining(int state) noexcept
+  {
+    return state == Source::active || state == Source::closing;
+  }
+
+  void drain_all_audio()
+  {
+    for (int i = 0; i < max_sources; i++)
+    {
+      auto& src = *sources[i];
+      if (!draining(source_states[i]) || src.kind != source_kind::audio)
+        continue;
+      if (shm)
+        drain_shared(src, shm->sources[i], i);
+      else
+        drain_audio(src, i);
     }
+  }
+
+  // Samples per encoder frame. Host blocks are accumulated into buffers of
+  // exactly that size, which the encoder takes without reblocking; they
+  // only stay aligned when the host runs at the encoder rate, 48 kHz.
+  int audio_chunk_frames() const noexcept
+  {
+    return std::max(1, int(std::lround(conf.rate * conf.opus_frame_ms / 1000.)));
+  }
 
-    kmax = 20;
-    while(video_buffer* p = video_to_send.front())
+  // Each chunk goes to the receivers subscribed to the track
+  void drain_audio(Source& src, int index)
+  {
+    const std::size_t frame_bytes = src.channels * sample_size(src.format);
+    while (audio_buffer* p = src.audio_to_send.front())
     {
-      for(auto& receiver : receivers) {
-        receiver->push_data_video(*p);
+      trace_event("dequeue", source_kind::audio, trace_id(index, p->seq));
+      src.measure_queue_wait(g_get_real_time() - p->capture_us);
+      const std::size_t size = p->frames * frame_bytes;
+      if (size <= src.pending.space())
+      {
+        src.pending_blocks.push_back({src.pending.write, p->seq, p->capture_us});
+        src.pending.push((const unsigned char*)p->data, size);
+        send_pending_audio(src, index);
       }
 
-      video_to_free.push(*p);
-      video_to_send.pop();
+      src.audio_to_free.push(*p);
+      src.audio_to_send.pop();
+    }
+  }
 
-      if(kmax-- < 0)
-        break;
+  // Each chunk carries the sequence number of the block it starts in, and
+  // the capture time of its first sample
+  void send_pending_audio(Source& src, int index)
+  {
+    const std::size_t frame_bytes = src.channels * sample_size(src.format);
+    const std::size_t chunk_bytes = audio_chunk_frames() * frame_bytes;
+    auto& blocks = src.pending_blocks;
+
+    while (src.pending.size() >= chunk_bytes)
+    {
+      const uint64_t start = src.pending.read;
+      while (blocks.size() > 1 && blocks[1].position <= start)
+        blocks.pop_front();
+      const pending_block block = blocks.empty() ? pending_block{start, 0, g_get_real_time()}
+                                                 : blocks.front();
+      const int64_t capture_us
+          = block.capture_us
+            + int64_t((start - std::min(start, block.position)) / frame_bytes) * G_USEC_PER_SEC
+                  / conf.rate;
+
+      const unsigned char* chunk = src.pending.peek(chunk_bytes, src.chunk_scratch.data());
+      for (auto& receiver : receivers)
+        for (auto& track : receiver->tracks)
+          if (track->source == index && track->generation == src.generation)
+            receiver->push_data_audio(
+                  *track, chunk, audio_chunk_frames(), block.seq, capture_us);
+      src.pending.pop(chunk_bytes);
+    }
+  }
+
+  void drain_video(Source& src, int index)
+  {
+    if (!src.video.update())
+      return;
+
+    auto& frame = src.video.read_buffer();
+    if (frame.seq > src.video_last_seq + 1 && src.video_last_seq > 0)
+      src.video_frames_skipped += frame.seq - src.video_last_seq - 1;
+    src.video_last_seq = frame.seq;
+
+    trace_event("dequeue", source_kind::video, trace_id(index, frame.seq));
+    video_buffer p{
+        .bytes = frame.bytes.data(),
+        .width = frame.width,
+        .height = frame.height,
+        .seq = frame.seq,
+        .capture_us = frame.capture_us};
+    for (auto& receiver : receivers)
+      for (auto& track : receiver->tracks)
+        if (track->source == index && track->generation == src.generation)
+          receiver->push_data_video(*track, p);
+  }
+
+  //// Out of process
+
+  // Server side: the host's sources become local ones, under the same
+  // generation so that the tracks follow its registrations. Slots it
+  // closed are freed for it to reuse.
+  void mirror_shared_sources()
+  {
+    for (int i = 0; i < max_sources; i++)
+    {
+      auto& in = shm->sources[i];
+      auto& src = *sources[i];
+      const int state = in.state.load(std::memory_order_acquire);
+      const uint32_t generation = in.generation.load(std::memory_order_acquire);
+
+      if (src.state == Source::active
+          && (state != shm_active || src.generation != generation))
+        src.release();
+
+      if (state == shm_active && src.state == Source::free_slot)
+      {
+        src.kind = in.kind;
+        src.channels = in.channels;
+        src.format = in.format;
+        src.name.assign(in.name, strnlen(in.name, sizeof(in.name)));
+        src.generation = generation;
+        src.state = Source::active;
+      }
+      else if (state == shm_closing)
+      {
+        in.audio_read.store(
+              in.audio_write.load(std::memory_order_acquire), std::memory_order_release);
+        in.state.store(shm_free, std::memory_order_release);
+      }
+    }
+  }
+
+  void drain_shared(Source& src, shm_source& in, int index)
+  {
+    if (src.kind == source_kind::audio)
+    {
+      // Whole frames only, as much as the ring takes
+      const std::size_t frame_bytes = src.channels * sample_size(src.format);
+      const uint64_t position = src.pending.write;
+      const std::size_t available = shm_audio_available(in);
+      const std::size_t read = shm_audio_read(
+            in, src.pending.space() / frame_bytes * frame_bytes,
+            [&](const unsigned char* data, std::size_t size) { src.pending.push(data, size); });
+      if (read == 0)
+        return;
+
+      // Only the time of the last write crosses over: to within a block
+      const int64_t capture_us = in.audio_capture_us.load(std::memory_order_relaxed)
+                                 - int64_t(available / frame_bytes) * G_USEC_PER_SEC / conf.rate;
+      const uint64_t seq = src.sequence++;
+      src.pending_blocks.push_back({position, seq, capture_us});
+      trace_event("dequeue", source_kind::audio, trace_id(index, seq));
+      send_pending_audio(src, index);
+      return;
+    }
+
+    shm_video_slot* slot = shm_video_acquire(in, src.video_last_seq);
+    if (!slot)
+      return;
+
+    if (slot->seq > src.video_last_seq + 1 && src.video_last_seq > 0)
+      src.video_frames_skipped += slot->seq - src.video_last_seq - 1;
+    src.video_last_seq = slot->seq;
+
+    trace_event("dequeue", source_kind::video, trace_id(index, slot->seq));
+    video_buffer p{
+        .bytes = shm_frame_data(*shm, *slot),
+        .width = slot->width,
+        .height = slot->height,
+        .seq = slot->seq,
+        .capture_us = slot->capture_us,
+        .slot = slot};
+    for (auto& receiver : receivers)
+      for (auto& track : receiver->tracks)
+        if (track->source == index && track->generation == src.generation)
+          receiver->push_data_video(*track, p);
+
+    // Each buffer holds its own reference
+    shm_video_release(*slot);
+  }
+
+  // Host side: nothing here runs GStreamer, the media goes into a memfd
+  // which the server maps
+  bool start_host()
+  {
+#if defined(__linux__)
+    // Frames stay aligned for the converters
+    const std::size_t frame_bytes = (conf.shm_frame_bytes + 63) & ~std::size_t(63);
+    const std::size_t total_size = shm_total_size(frame_bytes);
+    shm_fd = memfd_create("witchbridge", MFD_CLOEXEC);
+    if (shm_fd < 0 || ftruncate(shm_fd, total_size) < 0)
+    {
+      g_warning("Cannot create the shared memory: %s", g_strerror(errno));
+      return false;
+    }
+
+    void* memory = mmap(
+          nullptr, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (memory == MAP_FAILED)
+    {
+      g_warning("Cannot map the shared memory: %s", g_strerror(errno));
+      return false;
     }
+
+    const std::string json = config_to_json(conf);
+    if (json.size() >= shm_config_bytes)
+    {
+      g_warning("Config too large for the shared memory");
+      munmap(memory, total_size);
+      return false;
+    }
+
+    // Value-initializes the atomics, which allocates the pages of each
+    // source and slot header, a few per source. The audio rings and the
+    // frames stay unallocated until written to.
+    shm = new (memory) shm_header;
+    shm->magic = shm_magic;
+    shm->version = shm_version;
+    shm->size = sizeof(shm_header);
+    shm->frame_bytes = frame_bytes;
+    shm->total_size = total_size;
+    memcpy(shm->config_json, json.c_str(), json.size() + 1);
+
+    std::size_t offset = sizeof(shm_header);
+    for (auto& src : shm->sources)
+      for (auto& slot : src.video)
+      {
+        slot.offset = offset;
+        offset += frame_bytes;
+      }
+
+    for (int i = 0; i < max_sources; i++)
+      sources[i]->shm = &shm->sources[i];
+    host = true;
     return true;
+#else
+    return false;
+#endif
+  }
+
+  // Host side: restarts the server whenever it exits
+  void supervise(std::stop_token stop)
+  {
+#if defined(__linux__)
+    // Everything the child needs is ready before the fork, where only
+    // async-signal-safe calls are allowed
+    gchar* path = conf.server_path.find('/') == std::string::npos
+                      ? g_find_program_in_path(conf.server_path.c_str())
+                      : g_strdup(conf.server_path.c_str());
+    if (!path)
+    {
+      g_warning("%s not found, nothing serves the viewers", conf.server_path.c_str());
+      return;
+    }
+    const std::string fd_arg = std::to_string(shm_fd);
+    char* const argv[] = {path, const_cast<char*>(fd_arg.c_str()), nullptr};
+
+    while (!stop.stop_requested())
+    {
+      shm_reset_readers(*shm);
+      {
+        std::lock_guard lock{server_lock};
+        if (stop.stop_requested())
+          break;
+
+        server_pid = fork();
+        if (server_pid == 0)
+        {
+          prctl(PR_SET_PDEATHSIG, SIGTERM);
+          fcntl(shm_fd, F_SETFD, 0);
+          execv(path, argv);
+          _exit(127);
+        }
+      }
+
+      if (server_pid > 0)
+      {
+        int status{};
+        while (waitpid(server_pid, &status, 0) < 0 && errno == EINTR)
+          ;
+        std::lock_guard lock{server_lock};
+        server_pid = 0;
+      }
+
+      if (stop.stop_requested())
+        break;
+      g_warning("%s exited, restarting it", path);
+      for (int i = 0; i < 10 && !stop.stop_requested(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    g_free(path);
+#endif
+  }
+
+  void stop_host()
+  {
+#if defined(__linux__)
+    impl.request_stop();
+    {
+      std::lock_guard lock{server_lock};
+      if (server_pid > 0)
+        kill(server_pid, SIGTERM);
+    }
+    impl.join();
+    munmap(shm, shm->total_size);
+    close(shm_fd);
+#endif
   }
 
-  Streamer(config c)
+  // With input, serves what a host writes into that shared memory
+  Streamer(config c, shm_header* input = nullptr)
     : conf(c)
-    , audio_to_send(64)
-    , audio_to_free(64)
-    , video_to_send(16)
-    , video_to_free(16)
+    , shm(input)
     // , storage(4096 * 16)
   {
+    // Registering only fills them: names up to what the shared memory keeps
+    for (int i = 0; i < max_sources; i++)
+    {
+      sources.push_back(std::make_unique<Source>());
+      sources.back()->streamer = this;
+      sources.back()->index = i;
+      sources.back()->name.reserve(sizeof(shm_source::name));
+    }
+
+    if (!shm && conf.out_of_process)
+    {
+      if (start_host())
+      {
+        ready = true;
+        impl = std::jthread{[this](std::stop_token stop) { supervise(stop); }};
+        return;
+      }
+      g_warning("Encoding in process instead");
+    }
+
+    // Host blocks larger than these are split. Out of process, the main
+    // loop takes at most 64 kB from the shared ring at a time.
+    const std::size_t max_frame_bytes = 2 * sizeof(float);
+    const std::size_t chunk_bytes = audio_chunk_frames() * max_frame_bytes;
+    const int block_frames = std::max(conf.frames, 64);
+    const std::size_t block_bytes = shm ? 1 << 16 : block_frames * max_frame_bytes;
+    for (auto& src : sources)
+    {
+      if (!shm)
+        src->allocate_audio_pool(block_frames);
+      src->allocate_pending(2 * (chunk_bytes + block_bytes), chunk_bytes);
+    }
+
+    if (shm)
+    {
+      // What the host wrote while no server was running is stale
+      conf.receive = false;
+      for (auto& in : shm->sources)
+      {
+        in.audio_read.store(in.audio_write.load());
+        if (in.state == shm_closing)
+          in.state = shm_free;
+      }
+    }
+
     static bool init = (gst_init(nullptr, nullptr), true);
 
+#if defined(WITCHBRIDGE_TRACING)
+    if (!conf.trace_path.empty())
+      tracer.start();
+#endif
+
+    // One second of stereo per viewer sending audio back
+    if (conf.receive)
+      for (int i = 0; i < 8; i++)
+        remote_peers.push_back(std::make_unique<remote_peer>(std::max(conf.rate, 48000) * 2));
+
     impl = std::jthread{[this, c] { run(); } };
   }
 
   ~Streamer()
   {
+    if (host)
+    {
+      stop_host();
+      return;
+    }
+
     g_main_loop_quit(mainloop);
     impl.join();
 
@@ -901,13 +5683,99 @@ unknown_message:
   }
 
   std::vector<std::shared_ptr<ReceiverEntry>> receivers;
+
+  struct fmp4_client
+  {
+    SoupWebsocketConnection* connection{};
+    GSocket* socket{};
+    bool header_sent{};
+    bool synced{};
+    // Since when it is over fmp4_max_queued_bytes, 0 if it is not
+    gint64 stalled_since{};
+  };
+  std::shared_ptr<ReceiverEntry> fmp4;
+  // Only while no WebRTC viewer encodes the fMP4 tracks
+  std::shared_ptr<ReceiverEntry> fmp4_encoder;
+  // Whose tees feed the muxer, and its pipeline then: a restart replaces it
+  std::weak_ptr<ReceiverEntry> fmp4_donor;
+  GstElement* fmp4_donor_pipeline{};
+  std::vector<std::pair<int, uint32_t>> fmp4_tracks;
+  guint32 fmp4_video_track{};
+  std::shared_ptr<fmp4_timeline> fmp4_time;
+  // Generation of the active source in each slot, 0 if none, as of the
+  // last update_tracks
+  std::vector<uint32_t> published_tracks = std::vector<uint32_t>(max_sources);
+  // As of the start of the current buffer_read_timeout
+  std::vector<int> source_states = std::vector<int>(max_sources);
+  int next_video_source{};
+  gint64 pacing_query_us{};
+  std::vector<fmp4_client> fmp4_clients;
+  std::vector<std::shared_ptr<ReceiverEntry>> local_outputs;
+  std::vector<unsigned char> fmp4_header;
+  bool fmp4_header_done{};
   // boost::pool<> storage;
-  rigtorp::SPSCQueue<audio_buffer> audio_to_send;
-  rigtorp::SPSCQueue<audio_buffer> audio_to_free;
 
-  rigtorp::SPSCQueue<video_buffer> video_to_free;
-  rigtorp::SPSCQueue<video_buffer> video_to_send;
+  static constexpr int max_sources = 64;
+  static_assert(max_sources == shm_max_sources);
+  std::vector<std::unique_ptr<Source>> sources;
   std::atomic_bool ready = false;
+
+  // Out of process: written to on the host side, read from on the server
+  // side, which runs in its own process
+  shm_header* shm{};
+  bool host{};
+  int shm_fd{-1};
+  std::mutex server_lock;
+  int server_pid{};
+
+  boost::lockfree::queue<control_message, boost::lockfree::capacity<1024>>
+      controls_received;
+
+  std::vector<std::unique_ptr<remote_peer>> remote_peers;
+  std::atomic<const void*> remote_audio_owner{};
+  std::vector<float> remote_audio_scratch = std::vector<float>(8192 * 2);
+
+  triple_buffer<video_frame> remote_video;
+  std::atomic<ReceiverEntry*> remote_video_owner{};
+  std::atomic<const void*> remote_video_reader{};
+
+  std::atomic<float> remote_jitter_ms{};
+  std::atomic<float> remote_latency_ms{};
+
+  struct
+  {
+    std::atomic<uint64_t> errors{};
+    std::atomic<uint64_t> restarts{};
+    std::atomic<uint64_t> recovered{};
+    std::atomic<uint64_t> dropped{};
+    std::atomic<double> restart_ms_last{};
+    std::atomic<double> restart_ms_max{};
+    std::atomic<double> outage_ms_last{};
+    std::atomic<double> outage_ms_total{};
+    std::atomic<uint64_t> rejected{};
+    std::atomic<uint64_t> degraded{};
+    std::atomic<uint64_t> setups{};
+    std::atomic<double> setup_ms_last{};
+    std::atomic<double> setup_ms_mean{};
+    std::atomic<uint64_t> resumes{};
+    std::atomic<uint64_t> expired{};
+    std::atomic<double> resume_ms_last{};
+    std::atomic<double> resume_ms_mean{};
+    std::atomic<uint64_t> video_deferred{};
+  } stats;
+
+  // Main loop only
+  struct
+  {
+    // Of every thread, at the last sample
+    std::unordered_map<int, uint64_t> thread_ticks;
+    gint64 last_sample_us{};
+    double viewer_cores{};
+    double cores_per_viewer{};
+    int kbps{};
+  } load;
+  bool quitting{};
+  int viewer_ids{};
 };
 
 std::shared_ptr<Streamer> make_streamer(config c)
@@ -916,61 +5784,402 @@ std::shared_ptr<Streamer> make_streamer(config c)
   return s;
 }
 
-void push_audio(Streamer& s, audio_buffer_view a)
+//// Out of process
+
+static JsonObject* thread_settings_to_json(const thread_settings& t)
 {
-  if(!s.ready)
-    return;
+  JsonObject* object = json_object_new();
+  JsonArray* cpus = json_array_new();
+  for (int cpu : t.cpus)
+    json_array_add_int_element(cpus, cpu);
+  json_object_set_array_member(object, "cpus", cpus);
+  json_object_set_int_member(object, "fifo_priority", t.fifo_priority);
+  json_object_set_int_member(object, "nice", t.nice);
+  return object;
+}
 
-  if(s.audio_to_send.size() >= s.audio_to_send.capacity())
-    return;
+static thread_settings thread_settings_from_json(JsonObject* object)
+{
+  thread_settings t;
+  JsonArray* cpus = json_object_get_array_member(object, "cpus");
+  for (guint i = 0; i < json_array_get_length(cpus); i++)
+    t.cpus.push_back(json_array_get_int_element(cpus, i));
+  t.fifo_priority = json_object_get_int_member(object, "fifo_priority");
+  t.nice = json_object_get_int_member(object, "nice");
+  return t;
+}
+
+static JsonObject* playout_delay_to_json(const playout_delay& p)
+{
+  JsonObject* object = json_object_new();
+  json_object_set_int_member(object, "min_ms", p.min_ms);
+  json_object_set_int_member(object, "max_ms", p.max_ms);
+  return object;
+}
+
+static playout_delay playout_delay_from_json(JsonObject* object)
+{
+  return {
+      .min_ms = int(json_object_get_int_member(object, "min_ms")),
+      .max_ms = int(json_object_get_int_member(object, "max_ms"))};
+}
+
+std::string config_to_json(const config& c)
+{
+  JsonObject* object = json_object_new();
+  json_object_set_int_member(object, "port", c.port);
+  json_object_set_string_member(object, "path", c.path.c_str());
+  json_object_set_int_member(object, "rate", c.rate);
+  json_object_set_int_member(object, "frames", c.frames);
+  json_object_set_int_member(object, "whep_ice_timeout_ms", c.whep_ice_timeout_ms);
+  json_object_set_int_member(
+        object, "whep_disconnect_timeout_ms", c.whep_disconnect_timeout_ms);
+  json_object_set_int_member(object, "ice", int(c.ice));
+  json_object_set_string_member(object, "stun_server", c.stun_server.c_str());
+  json_object_set_int_member(object, "ice_min_port", c.ice_min_port);
+  json_object_set_int_member(object, "ice_max_port", c.ice_max_port);
+  json_object_set_double_member(object, "cpu_budget", c.cpu_budget);
+  json_object_set_int_member(object, "bandwidth_budget_kbps", c.bandwidth_budget_kbps);
+  json_object_set_int_member(object, "max_viewers", c.max_viewers);
+  json_object_set_int_member(object, "resume_grace_ms", c.resume_grace_ms);
+  json_object_set_object_member(object, "playout", playout_delay_to_json(c.playout));
+  JsonObject* track_playout = json_object_new();
+  for (auto& [name, playout] : c.track_playout)
+    json_object_set_object_member(
+          track_playout, name.c_str(), playout_delay_to_json(playout));
+  json_object_set_object_member(object, "track_playout", track_playout);
+  json_object_set_boolean_member(object, "capture_time", c.capture_time);
+  json_object_set_int_member(object, "fmp4_fragment_ms", c.fmp4_fragment_ms);
+  json_object_set_int_member(object, "fmp4_max_queued_bytes", c.fmp4_max_queued_bytes);
+  json_object_set_double_member(object, "opus_frame_ms", c.opus_frame_ms);
+  json_object_set_boolean_member(object, "receive", c.receive);
+  json_object_set_int_member(object, "jitter_min_ms", c.jitter_min_ms);
+  json_object_set_int_member(object, "jitter_max_ms", c.jitter_max_ms);
+  json_object_set_object_member(
+        object, "streamer_thread", thread_settings_to_json(c.streamer_thread));
+  json_object_set_object_member(
+        object, "encoder_threads", thread_settings_to_json(c.encoder_threads));
+  json_object_set_object_member(
+        object, "network_threads", thread_settings_to_json(c.network_threads));
+  json_object_set_int_member(object, "x264_threads", c.x264_threads);
+  json_object_set_boolean_member(object, "x264_sliced_threads", c.x264_sliced_threads);
+  json_object_set_string_member(object, "audio_priority", c.audio_priority.c_str());
+  json_object_set_string_member(object, "video_priority", c.video_priority.c_str());
+  json_object_set_int_member(object, "video_budget_us", c.video_budget_us);
+  json_object_set_double_member(object, "pacing_factor", c.pacing_factor);
+  json_object_set_int_member(object, "pacer_max_delay_ms", c.pacer_max_delay_ms);
+  json_object_set_string_member(object, "local_path", c.local_path.c_str());
+  json_object_set_boolean_member(object, "local_encoded", c.local_encoded);
+  json_object_set_string_member(object, "trace_path", c.trace_path.c_str());
+
+  gchar* text = Streamer::get_string_from_json_object(object);
+  json_object_unref(object);
+  std::string json = text;
+  g_free(text);
+  return json;
+}
+
+config config_from_json(const char* json)
+{
+  config c{};
+  JsonParser* parser = json_parser_new();
+  if (!json_parser_load_from_data(parser, json, -1, nullptr)
+      || !JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser)))
+  {
+    g_warning("Invalid config from the host");
+    g_object_unref(parser);
+    return c;
+  }
+
+  JsonObject* object = json_node_get_object(json_parser_get_root(parser));
+  c.port = json_object_get_int_member(object, "port");
+  c.path = json_object_get_string_member(object, "path");
+  c.rate = json_object_get_int_member(object, "rate");
+  c.frames = json_object_get_int_member(object, "frames");
+  c.whep_ice_timeout_ms = json_object_get_int_member(object, "whep_ice_timeout_ms");
+  c.whep_disconnect_timeout_ms
+      = json_object_get_int_member(object, "whep_disconnect_timeout_ms");
+  c.ice = ice_policy(json_object_get_int_member(object, "ice"));
+  c.stun_server = json_object_get_string_member(object, "stun_server");
+  c.ice_min_port = json_object_get_int_member(object, "ice_min_port");
+  c.ice_max_port = json_object_get_int_member(object, "ice_max_port");
+  c.cpu_budget = json_object_get_double_member(object, "cpu_budget");
+  c.bandwidth_budget_kbps = json_object_get_int_member(object, "bandwidth_budget_kbps");
+  c.max_viewers = json_object_get_int_member(object, "max_viewers");
+  c.resume_grace_ms = json_object_get_int_member(object, "resume_grace_ms");
+  c.playout = playout_delay_from_json(json_object_get_object_member(object, "playout"));
+  JsonObject* track_playout = json_object_get_object_member(object, "track_playout");
+  GList* names = json_object_get_members(track_playout);
+  for (GList* name = names; name; name = name->next)
+    c.track_playout[(const char*)name->data] = playout_delay_from_json(
+          json_object_get_object_member(track_playout, (const char*)name->data));
+  g_list_free(names);
+  c.capture_time = json_object_get_boolean_member(object, "capture_time");
+  c.fmp4_fragment_ms = json_object_get_int_member(object, "fmp4_fragment_ms");
+  c.fmp4_max_queued_bytes = json_object_get_int_member(object, "fmp4_max_queued_bytes");
+  c.opus_frame_ms = json_object_get_double_member(object, "opus_frame_ms");
+  c.receive = json_object_get_boolean_member(object, "receive");
+  c.jitter_min_ms = json_object_get_int_member(object, "jitter_min_ms");
+  c.jitter_max_ms = json_object_get_int_member(object, "jitter_max_ms");
+  c.streamer_thread = thread_settings_from_json(
+        json_object_get_object_member(object, "streamer_thread"));
+  c.encoder_threads = thread_settings_from_json(
+        json_object_get_object_member(object, "encoder_threads"));
+  c.network_threads = thread_settings_from_json(
+        json_object_get_object_member(object, "network_threads"));
+  c.x264_threads = json_object_get_int_member(object, "x264_threads");
+  c.x264_sliced_threads = json_object_get_boolean_member(object, "x264_sliced_threads");
+  c.audio_priority = json_object_get_string_member(object, "audio_priority");
+  c.video_priority = json_object_get_string_member(object, "video_priority");
+  c.video_budget_us = json_object_get_int_member(object, "video_budget_us");
+  c.pacing_factor = json_object_get_double_member(object, "pacing_factor");
+  c.pacer_max_delay_ms = json_object_get_int_member(object, "pacer_max_delay_ms");
+  c.local_path = json_object_get_string_member(object, "local_path");
+  c.local_encoded = json_object_get_boolean_member(object, "local_encoded");
+  c.trace_path = json_object_get_string_member(object, "trace_path");
+
+  g_object_unref(parser);
+  return c;
+}
+
+std::shared_ptr<Streamer> serve_shared_memory(config c, shm_header& shm)
+{
+  return std::make_shared<Streamer>(c, &shm);
+}
 
+// Called from the host threads: it does not allocate
+std::shared_ptr<Source> register_source(
+    Streamer& s, source_kind kind, std::string_view name, int channels, sample_format format)
+{
+  for(int i = 0; i < int(s.sources.size()); i++)
   {
-    while(auto p = s.audio_to_free.front()) {
-      free(p->audio[0]);
+    auto& src = s.sources[i];
+    // Out of process, the slot is the server's to free
+    auto& state = src->shm ? src->shm->state : src->state;
+    int expected = Source::free_slot;
+    if(state.compare_exchange_strong(expected, Source::claimed))
+    {
+      src->kind = kind;
+      src->channels = channels;
+      src->format = format;
+      src->generation++;
+
+      char default_name[16];
+      if(name.empty()) {
+        snprintf(default_name, sizeof(default_name), "%s %d",
+                 kind == source_kind::audio ? "audio" : "video", i);
+        name = default_name;
+      }
+      src->name.assign(name.substr(0, sizeof(shm_source::name) - 1));
 
-      s.audio_to_free.pop();
+      if(auto* out = src->shm)
+      {
+        out->kind = kind;
+        out->channels = channels;
+        out->format = format;
+        snprintf(out->name, sizeof(out->name), "%s", src->name.c_str());
+        out->video_latest.store(-1, std::memory_order_relaxed);
+        out->generation.store(src->generation, std::memory_order_relaxed);
+        src->sequence = 0;
+      }
+      state.store(Source::active, std::memory_order_release);
+
+      // The main loop frees what is left in the queues, then the slot
+      auto& block = src->handle_blocks[src->handle_next++ % 2];
+      return std::shared_ptr<Source>(
+          src.get(),
+          [](Source* src) { (src->shm ? src->shm->state : src->state) = Source::closing; },
+          slot_allocator<Source>{block, sizeof(block)});
     }
   }
 
-  // FIXME use a proper memory pool
-  auto buf = (float*)malloc(a.channels * a.frames * sizeof(float));
+  g_warning("Too many sources registered");
+  return {};
+}
+
+// Straight into the ring, in two parts when the block wraps around it
+template <int Channels, sample_format Format>
+static void push_audio_shared(Source& src, const audio_buffer_view& a, int64_t capture_us)
+{
+  auto& out = *src.shm;
+  constexpr std::size_t frame_bytes = Channels * sample_size(Format);
+  const std::size_t size = a.frames * frame_bytes;
 
-  audio_buffer bb{.audio = {buf}, .channels = a.channels, .frames = a.frames};
-  if(a.channels == 2) {
-    bb.audio[1] = bb.audio[0] + a.frames;
-  }
+  auto parts = shm_audio_reserve(out, size);
+  if(!parts)
+    return;
 
-  for(int c = 0; c < a.channels; c++) {
-    std::copy_n(a.audio[c], a.frames, bb.audio[c]);
-  }
+  audio_buffer_view part = a;
+  part.frames = parts->first_size / frame_bytes;
+  interleave<Channels, Format>(part, parts->first);
+  for(int c = 0; c < Channels; c++)
+    part.audio[c] += part.frames;
+  part.frames = a.frames - part.frames;
+  interleave<Channels, Format>(part, out.audio);
+
+  trace_event("push", source_kind::audio, trace_id(src.index, src.sequence++));
+  shm_audio_commit(out, size, capture_us);
+}
+
+template <int Channels, sample_format Format>
+void push_audio(Source& src, audio_buffer_view a)
+{
+  static_assert(Channels >= 1 && Channels <= 2);
+  auto& s = *src.streamer;
+  const int64_t capture_us = g_get_real_time();
+  src.measure_callback_jitter(a.frames, s.conf.rate);
+
+  if(!s.ready)
+    return;
 
-  s.audio_to_send.push(bb);
+  if(src.shm)
+    return push_audio_shared<Channels, Format>(src, a, capture_us);
+
+  // Host blocks larger than the pool ones are split
+  for(int offset = 0; offset < a.frames; offset += src.audio_block_frames) {
+    void* buf = src.take_audio_block();
+    if(!buf)
+      return;
+
+    audio_buffer_view part = a;
+    for(int c = 0; c < Channels; c++)
+      part.audio[c] += offset;
+    part.frames = std::min(src.audio_block_frames, a.frames - offset);
+    interleave<Channels, Format>(part, buf);
+
+    const uint64_t seq = src.sequence++;
+    const int64_t offset_us = int64_t(offset) * G_USEC_PER_SEC / std::max(s.conf.rate, 1);
+    trace_event("push", source_kind::audio, trace_id(src.index, seq));
+    src.audio_to_send.push(
+        {.data = buf,
+         .channels = Channels,
+         .frames = part.frames,
+         .seq = seq,
+         .capture_us = capture_us + offset_us});
+  }
 }
 
-void push_video(Streamer& s, video_buffer_view a)
+template void push_audio<1, sample_format::f32>(Source&, audio_buffer_view);
+template void push_audio<2, sample_format::f32>(Source&, audio_buffer_view);
+template void push_audio<1, sample_format::s16>(Source&, audio_buffer_view);
+template void push_audio<2, sample_format::s16>(Source&, audio_buffer_view);
+
+void push_video(Source& src, video_buffer_view a)
 {
+  auto& s = *src.streamer;
   if(!s.ready)
     return;
 
-  if(s.video_to_send.size() >= s.video_to_send.capacity())
+  if(auto* out = src.shm)
+  {
+    // Dropped rather than waited for when the server holds every slot
+    const std::size_t size = std::size_t(a.width) * a.height * 4;
+    shm_video_slot* slot = size <= s.shm->frame_bytes ? shm_video_claim(*out) : nullptr;
+    if(!slot)
+    {
+      out->video_frames_dropped++;
+      return;
+    }
+
+    memcpy(shm_frame_data(*s.shm, *slot), a.bytes, size);
+    slot->width = a.width;
+    slot->height = a.height;
+    slot->seq = ++src.sequence;
+    slot->capture_us = g_get_real_time();
+    trace_event("push", source_kind::video, trace_id(src.index, slot->seq));
+
+    shm_video_publish(*out, *slot);
+    return;
+  }
+
+  // Only allocates when the size changes
+  auto& frame = src.video.write_buffer();
+  frame.bytes.resize(a.width * a.height * 4);
+  frame.width = a.width;
+  frame.height = a.height;
+  frame.seq = ++src.sequence;
+  frame.capture_us = g_get_real_time();
+
+  memcpy(frame.bytes.data(), a.bytes, a.width * a.height * 4);
+  trace_event("push", source_kind::video, trace_id(src.index, frame.seq));
+
+  src.video.publish();
+}
+
+bool pop_control(Streamer& s, control_message& m)
+{
+  return s.controls_received.pop(m);
+}
+
+// Only one node at a time consumes what viewers send back: the first one
+// asking for it, until it releases it.
+static bool claim_remote(std::atomic<const void*>& owner, const void* node)
+{
+  const void* expected = nullptr;
+  return owner.compare_exchange_strong(expected, node) || expected == node;
+}
+
+void pull_audio(Streamer& s, const void* owner, audio_buffer_view a)
+{
+  for(int c = 0; c < a.channels; c++)
+    std::fill_n(a.audio[c], a.frames, 0.f);
+
+  if(!claim_remote(s.remote_audio_owner, owner))
     return;
 
+  const int frames = std::min(a.frames, int(s.remote_audio_scratch.size() / 2));
+  // Enough queued audio to ride out one late host block, more is latency
+  const std::size_t target = 2 * (2 * frames + s.conf.rate / 200);
+  float* scratch = s.remote_audio_scratch.data();
+
+  for(auto& peer : s.remote_peers)
   {
-    while(auto p = s.video_to_free.front()) {
-      free(p->bytes);
+    if(!peer->active)
+      continue;
+
+    while(peer->audio.read_available() > target)
+      peer->audio.pop(scratch, std::min(peer->audio.read_available() - target, s.remote_audio_scratch.size()));
 
-      s.video_to_free.pop();
+    const int read = peer->audio.pop(scratch, 2 * frames) / 2;
+    for(int f = 0; f < read; f++)
+    {
+      if(a.channels == 1)
+      {
+        a.audio[0][f] += 0.5f * (scratch[2 * f] + scratch[2 * f + 1]);
+      }
+      else
+      {
+        a.audio[0][f] += scratch[2 * f];
+        a.audio[1][f] += scratch[2 * f + 1];
+      }
     }
   }
+}
+
+bool pull_video(Streamer& s, const void* owner, video_buffer_view& v)
+{
+  if(!claim_remote(s.remote_video_reader, owner))
+    return false;
 
-  // FIXME use a proper memory pool
-  auto buf = (unsigned char*)malloc(a.width * a.height * 4);
+  if(!s.remote_video.update())
+    return false;
 
-  video_buffer bb{.bytes = buf, .width = a.width, .height = a.height};
+  auto& frame = s.remote_video.read_buffer();
+  v = {.bytes = frame.bytes.data(), .width = frame.width, .height = frame.height};
+  return frame.width > 0 && frame.height > 0;
+}
 
-  memcpy(buf, a.bytes, a.width * a.height * 4);
+void release_remote(Streamer& s, const void* owner)
+{
+  const void* expected = owner;
+  s.remote_audio_owner.compare_exchange_strong(expected, nullptr);
+  expected = owner;
+  s.remote_video_reader.compare_exchange_strong(expected, nullptr);
+}
 
-  s.video_to_send.push(bb);
+remote_status get_remote_status(Streamer& s)
+{
+  return {.jitter_ms = s.remote_jitter_ms, .latency_ms = s.remote_latency_ms};
 }
 
 audio_frame ReceiverEntry::next_frame() noexcept
@@ -983,56 +6192,71 @@ audio_frame ReceiverEntry::next_frame() noexcept
   return res;
 }
 
-bool ReceiverEntry::push_data_audio(audio_buffer buf)
+bool ReceiverEntry::push_data_audio(
+    track_input& track,
+    const unsigned char* data,
+    int frames,
+    uint64_t seq,
+    int64_t capture_us)
 {
-  if(audio_feed == 0)
+  if(track.feed == 0)
     return true;
 
-  const gint num_samples = buf.frames;
-  GstBuffer* buffer = gst_buffer_new_and_alloc(buf.frames * sizeof(float));
+  // Already in the format of the appsrc caps
+  const auto& src = *self->sources[track.source];
+  const gsize size = gsize(frames) * src.channels * sample_size(src.format);
+  GstBuffer* buffer{};
+  if(gst_buffer_pool_acquire_buffer(track.pool, &buffer, nullptr) != GST_FLOW_OK)
+    return false;
 
   GST_BUFFER_TIMESTAMP(buffer)
-      = gst_util_uint64_scale(this->num_samples, GST_SECOND, self->conf.rate);
+      = gst_util_uint64_scale(track.position, GST_SECOND, self->conf.rate);
   GST_BUFFER_DURATION(buffer)
-      = gst_util_uint64_scale(num_samples, GST_SECOND, self->conf.rate);
+      = gst_util_uint64_scale(frames, GST_SECOND, self->conf.rate);
 
-  GstMapInfo map{};
-
-  gst_buffer_map(buffer, &map, GST_MAP_WRITE);
-
-  auto raw = (float*)map.data;
-
-  for (int i = 0; i < buf.frames; i++)
-  {
-    raw[i] = buf.audio[0][i];
-  }
-  this->num_samples += num_samples;
+  gst_buffer_fill(buffer, 0, data, size);
+  track.position += frames;
 
-  gst_buffer_unmap(buffer, &map);
+  const uint64_t id = trace_id(track.source, seq);
+  trace_event("appsrc", source_kind::audio, id, this);
+  track.remember_pts(GST_BUFFER_PTS(buffer), id, capture_us);
+  gst_buffer_add_reference_timestamp_meta(
+        buffer, unix_time_caps(), capture_us * 1000, GST_CLOCK_TIME_NONE);
 
-  return gst_app_src_push_buffer(GST_APP_SRC(this->sound_in), buffer);
+  return gst_app_src_push_buffer(GST_APP_SRC(track.appsrc), buffer);
 }
 
-bool ReceiverEntry::push_data_video(video_buffer buf)
+bool ReceiverEntry::push_data_video(track_input& track, video_buffer buf)
 {
-  if(video_feed == 0)
+  if(track.feed == 0)
     return true;
 
-  GstBuffer* buffer = gst_buffer_new_and_alloc(buf.width * buf.height * 4);
-
+  const gsize size = gsize(buf.width) * buf.height * 4;
+  GstBuffer* buffer{};
+  if(buf.slot)
+  {
+    // The host can only reuse the slot once every buffer is gone
+    buf.slot->refs.fetch_add(1, std::memory_order_relaxed);
+    buffer = gst_buffer_new_wrapped_full(
+          GST_MEMORY_FLAG_READONLY, buf.bytes, size, 0, size, buf.slot,
+          +[](gpointer slot) { shm_video_release(*(shm_video_slot*)slot); });
+  }
+  else
+  {
+    buffer = gst_buffer_new_and_alloc(size);
+    gst_buffer_fill(buffer, 0, buf.bytes, size);
+  }
 
-  GST_BUFFER_DTS(buffer) = GST_BUFFER_PTS(buffer) = this->num_frames * 16666666;
-  // GST_BUFFER_TIMESTAMP(buffer) = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::microseconds(this->num_frames * 16666)).count();
+  GST_BUFFER_DTS(buffer) = GST_BUFFER_PTS(buffer) = track.position * 16666666;
+  // GST_BUFFER_TIMESTAMP(buffer) = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::microseconds(track.position * 16666)).count();
   // GST_BUFFER_DURATION(buffer) = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::microseconds(16666)).count();
-  GstMapInfo map{};
-
-  gst_buffer_map(buffer, &map, GST_MAP_WRITE);
-
-  auto raw = (unsigned char*)map.data;
-  memcpy(raw, buf.bytes, buf.width * buf.height * 4);
-  this->num_frames++;
+  track.position++;
 
-  gst_buffer_unmap(buffer, &map);
+  const uint64_t id = trace_id(track.source, buf.seq);
+  trace_event("appsrc", source_kind::video, id, this);
+  track.remember_pts(GST_BUFFER_PTS(buffer), id, buf.capture_us);
+  gst_buffer_add_reference_timestamp_meta(
+        buffer, unix_time_caps(), buf.capture_us * 1000, GST_CLOCK_TIME_NONE);
 
-  return gst_app_src_push_buffer(GST_APP_SRC(this->video_in), buffer);
+  return gst_app_src_push_buffer(GST_APP_SRC(track.appsrc), buffer);
 }
@@ -2,26 +2,50 @@
 #include "custom.hpp"
 #include <halp/meta.hpp>
 #include <halp/audio.hpp>
+#include <halp/controls.hpp>
 #include <halp/texture.hpp>
 
+#include <algorithm>
 #include <cmath>
 #include <memory>
+#include <optional>
+#include <string>
 #include <iostream>
 namespace wb
 {
-template<std::size_t N>
+#if defined(WITCHBRIDGE_S16_TRANSPORT)
+inline constexpr sample_format transport_format = sample_format::s16;
+#else
+inline constexpr sample_format transport_format = sample_format::f32;
+#endif
+
+template<std::size_t N, sample_format Format = transport_format>
 struct Audio
 {
   struct
   {
     halp::fixed_audio_bus<"In", float, N> audio;
+    halp::lineedit<"Track", ""> track;
   } inputs;
 
   struct
   {
+    halp::fixed_audio_bus<"Out", float, N> audio;
+    halp::val_port<"Jitter (ms)", float> jitter;
+    halp::val_port<"Buffer (ms)", float> buffer;
   } outputs;
 
   std::shared_ptr<Streamer> streamer;
+  std::shared_ptr<Source> source;
+  // Reserved ahead: renaming the track does not allocate on the audio thread
+  std::string track;
+  bool registered{};
+
+  ~Audio()
+  {
+    if(streamer)
+      release_remote(*streamer, this);
+  }
 
   void prepare(halp::setup t)
   {
@@ -30,24 +54,39 @@ struct Audio
     c.frames = t.frames;
 
     streamer = make_streamer(c);
+    track.reserve(256);
   }
 
   void operator()(int frames)
   {
     using namespace std;
 
-    switch(N) {
-    case 1:
-      push_audio(*streamer, {.audio = {inputs.audio.samples[0]}, .channels = N, .frames = frames});
-      break;
-    case 2:
-      push_audio(*streamer, {.audio = {
-                               inputs.audio.samples[0],
-                               inputs.audio.samples[1],
-                             },
-                             .channels = N, .frames = frames});
-      break;
+    // Inputs are only known once running: the track is published, or
+    // renamed, from there
+    if(!registered || inputs.track.value != track)
+    {
+      track.assign(inputs.track.value);
+      registered = true;
+      source.reset();
+      source = register_source(*streamer, source_kind::audio, track, N, Format);
+    }
+
+    audio_buffer_view in{.channels = N, .frames = frames};
+    audio_buffer_view out{.channels = N, .frames = frames};
+    for(std::size_t c = 0; c < N; c++) {
+      in.audio[c] = inputs.audio.samples[c];
+      out.audio[c] = outputs.audio.samples[c];
     }
+
+    if(source)
+      push_audio<N, Format>(*source, in);
+
+    // Whatever remote performers send back, in sendrecv mode
+    pull_audio(*streamer, this, out);
+
+    auto status = get_remote_status(*streamer);
+    outputs.jitter.value = status.jitter_ms;
+    outputs.buffer.value = status.latency_ms;
   }
 };
 
@@ -74,6 +113,7 @@ struct Texture
   struct
   {
     halp::texture_input<"In"> image;
+    halp::lineedit<"Track", ""> track;
   } inputs;
 
   struct
@@ -82,6 +122,8 @@ struct Texture
   } outputs;
 
   std::shared_ptr<Streamer> streamer;
+  std::shared_ptr<Source> source;
+  std::optional<std::string> track;
 
   Texture()
   {
@@ -95,15 +137,89 @@ struct Texture
     outputs.image.upload();
   }
 
+  ~Texture()
+  {
+    release_remote(*streamer, this);
+  }
+
   void operator()()
   {
     using namespace std;
 
-    push_video(*streamer,
-               {.bytes= inputs.image.texture.bytes
-               , .width = inputs.image.texture.width
-               , .height = inputs.image.texture.height
-               });
+    if(!track || inputs.track.value != *track)
+    {
+      track = inputs.track.value;
+      source.reset();
+      source = register_source(*streamer, source_kind::video, *track);
+    }
+
+    if(source)
+      push_video(*source,
+                 {.bytes= inputs.image.texture.bytes
+                 , .width = inputs.image.texture.width
+                 , .height = inputs.image.texture.height
+                 });
+
+    video_buffer_view remote;
+    if(pull_video(*streamer, this, remote))
+    {
+      auto& tex = outputs.image.texture;
+      if(tex.width != remote.width || tex.height != remote.height)
+        outputs.image.create(remote.width, remote.height);
+      std::copy_n(remote.bytes, remote.width * remote.height * 4, tex.bytes);
+      outputs.image.upload();
+    }
+  }
+};
+
+struct Control
+{
+  halp_meta(name, "Witchbridge Control")
+  halp_meta(c_name, "wb_control")
+  halp_meta(uuid, "1ac91358-9f77-4c1e-bea2-f3da2cbcbfa3")
+
+  struct
+  {
+    halp::val_port<"Control 1", float> c1;
+    halp::val_port<"Control 2", float> c2;
+    halp::val_port<"Control 3", float> c3;
+    halp::val_port<"Control 4", float> c4;
+    halp::val_port<"Control 5", float> c5;
+    halp::val_port<"Control 6", float> c6;
+    halp::val_port<"Control 7", float> c7;
+    halp::val_port<"Control 8", float> c8;
+    halp::val_port<"Latency (ms)", float> latency;
+  } outputs;
+
+  std::shared_ptr<Streamer> streamer;
+
+  Control()
+  {
+    config c;
+    c.rate = 1;
+    c.frames = 1;
+
+    streamer = make_streamer(c);
+  }
+
+  void operator()()
+  {
+    control_message m;
+    while(pop_control(*streamer, m))
+    {
+      switch(m.channel) {
+      case 0: outputs.c1.value = m.value; break;
+      case 1: outputs.c2.value = m.value; break;
+      case 2: outputs.c3.value = m.value; break;
+      case 3: outputs.c4.value = m.value; break;
+      case 4: outputs.c5.value = m.value; break;
+      case 5: outputs.c6.value = m.value; break;
+      case 6: outputs.c7.value = m.value; break;
+      case 7: outputs.c8.value = m.value; break;
+      default: continue;
+      }
+      outputs.latency.value = m.latency_ms;
+    }
   }
 };
 
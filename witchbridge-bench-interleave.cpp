@@ -0,0 +1,71 @@
+#include "interleave.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+// Cost of interleave<Channels, Format>, what push_audio does per block on
+// the host audio thread, for the usual host block sizes: median of 15 runs
+// of a few million samples each. Meaningful in a Release build only.
+
+namespace
+{
+template <int Channels, sample_format Format>
+double ns_per_block(int frames)
+{
+  std::vector<float> in[Channels];
+  for (int c = 0; c < Channels; c++)
+  {
+    in[c].resize(frames);
+    for (int f = 0; f < frames; f++)
+      in[c][f] = 0.9f * std::sin(0.01f * f + c);
+  }
+  // Two samples per frame at most, four bytes each at most
+  std::vector<float> out(std::size_t(frames) * 2);
+
+  audio_buffer_view view{.audio = {}, .channels = Channels, .frames = frames};
+  for (int c = 0; c < Channels; c++)
+    view.audio[c] = in[c].data();
+
+  using clock = std::chrono::steady_clock;
+  const int blocks = std::max(1000, 4'000'000 / frames);
+  std::vector<double> runs;
+  for (int run = 0; run < 15; run++)
+  {
+    const auto start = clock::now();
+    for (int b = 0; b < blocks; b++)
+    {
+      interleave<Channels, Format>(view, out.data());
+      // Keeps the stores from being optimized out of the loop
+      asm volatile("" : : "r"(out.data()) : "memory");
+    }
+    const std::chrono::duration<double, std::nano> elapsed = clock::now() - start;
+    runs.push_back(elapsed.count() / blocks);
+  }
+  std::nth_element(runs.begin(), runs.begin() + runs.size() / 2, runs.end());
+  return runs[runs.size() / 2];
+}
+
+template <int Channels, sample_format Format>
+void bench(const char* name)
+{
+  for (int frames : {32, 64, 128, 256, 512, 1024})
+  {
+    const double ns = ns_per_block<Channels, Format>(frames);
+    printf(
+        "%-10s %5d frames: %8.1f ns/block %6.3f ns/sample\n", name, frames, ns,
+        ns / (frames * Channels));
+  }
+}
+}
+
+int main()
+{
+  bench<1, sample_format::f32>("mono f32");
+  bench<2, sample_format::f32>("stereo f32");
+  bench<1, sample_format::s16>("mono s16");
+  bench<2, sample_format::s16>("stereo s16");
+  return 0;
+}
@@ -0,0 +1,250 @@
+#include "custom.hpp"
+#include "shm_ring.hpp"
+
+#include <glib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+// Audio callback jitter under encoding load: a simulated real-time host
+// callback pushes stereo blocks on its period while the Streamer encodes
+// the given number of video tracks, each with the viewer encoder settings
+// (through local encoded outputs, which need no peer). Reports how late
+// each callback woke up and how long push_audio took, as a distribution.
+//
+//   witchbridge-bench-jitter [--viewers N] [--seconds S] [--frames F]
+//                            [--rate R] [--size WxH] [--config file.json]
+//   witchbridge-bench-jitter --print-config > topology.json
+//
+// The config file is a full config as printed, e.g. with the thread
+// topology edited, to compare topologies under the same load.
+
+namespace
+{
+struct options
+{
+  int viewers{4};
+  int seconds{10};
+  int frames{128};
+  int rate{48000};
+  int width{1280};
+  int height{720};
+  const char* config_path{};
+  bool print_config{};
+};
+
+int64_t now_ns() noexcept
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return int64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+bool parse(int argc, char** argv, options& o)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string_view arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (arg == "--print-config")
+      o.print_config = true;
+    else if (!value)
+      return false;
+    else if (arg == "--viewers")
+      o.viewers = atoi(argv[++i]);
+    else if (arg == "--seconds")
+      o.seconds = atoi(argv[++i]);
+    else if (arg == "--frames")
+      o.frames = atoi(argv[++i]);
+    else if (arg == "--rate")
+      o.rate = atoi(argv[++i]);
+    else if (arg == "--size")
+    {
+      if (sscanf(argv[++i], "%dx%d", &o.width, &o.height) != 2)
+        return false;
+    }
+    else if (arg == "--config")
+      o.config_path = argv[++i];
+    else
+      return false;
+  }
+  return o.viewers >= 0 && o.viewers < shm_max_sources && o.seconds > 0
+         && o.frames > 0 && o.rate > 0 && o.width > 0 && o.height > 0;
+}
+
+void report(const char* what, std::vector<int64_t> ns)
+{
+  if (ns.empty())
+    return;
+  std::sort(ns.begin(), ns.end());
+  auto at = [&](double q) {
+    return ns[std::min(ns.size() - 1, std::size_t(q * ns.size()))] / 1000.;
+  };
+  double sum = 0.;
+  for (int64_t v : ns)
+    sum += v;
+
+  printf(
+      "%s (us): n=%zu mean=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+      what, ns.size(), sum / ns.size() / 1000., at(0.5), at(0.9), at(0.99), at(0.999),
+      ns.back() / 1000.);
+
+  // Below each power of two, in microseconds, the last one open-ended
+  constexpr int last = 15;
+  int buckets[last + 1]{};
+  for (int64_t v : ns)
+  {
+    const int64_t us = v / 1000;
+    int b = 0;
+    while (b < last && us >= (int64_t(1) << b))
+      b++;
+    buckets[b]++;
+  }
+  for (int b = 0; b <= last; b++)
+    if (buckets[b])
+      printf(
+          "  %s %6lld us: %d\n", b == last ? ">=" : "< ",
+          (long long)(int64_t(1) << (b == last ? last - 1 : b)), buckets[b]);
+}
+}
+
+int main(int argc, char** argv)
+{
+  options o;
+  if (!parse(argc, argv, o))
+  {
+    fprintf(
+        stderr,
+        "usage: %s [--viewers N] [--seconds S] [--frames F] [--rate R] [--size WxH] "
+        "[--config file.json] [--print-config]\n",
+        argv[0]);
+    return 1;
+  }
+
+  config c{};
+  if (o.config_path)
+  {
+    gchar* json = nullptr;
+    if (!g_file_get_contents(o.config_path, &json, nullptr, nullptr))
+    {
+      fprintf(stderr, "witchbridge-bench-jitter: cannot read %s\n", o.config_path);
+      return 1;
+    }
+    c = config_from_json(json);
+    g_free(json);
+  }
+  if (o.print_config)
+  {
+    printf("%s\n", config_to_json(c).c_str());
+    return 0;
+  }
+
+  // The load: one encoded local output per track
+  gchar* local = g_build_filename(g_get_tmp_dir(), "witchbridge-bench-XXXXXX", nullptr);
+  g_mkdtemp(local);
+  c.rate = o.rate;
+  c.frames = o.frames;
+  c.local_path = local;
+  c.local_encoded = true;
+  c.out_of_process = false;
+  g_free(local);
+
+  auto streamer = make_streamer(c);
+  auto audio = register_source(*streamer, source_kind::audio, "bench audio", 2);
+  std::vector<std::shared_ptr<Source>> videos;
+  for (int i = 0; i < o.viewers; i++)
+    videos.push_back(register_source(*streamer, source_kind::video, "bench video " + std::to_string(i)));
+
+  // Noise, shifted every frame: something for x264 to work on
+  std::vector<unsigned char> noise(std::size_t(o.width) * o.height * 4 * 2);
+  uint32_t x = 1;
+  for (auto& b : noise)
+  {
+    x = x * 1664525u + 1013904223u;
+    b = x >> 24;
+  }
+
+  std::atomic<bool> running{true};
+  std::jthread video_thread{[&] {
+    const int64_t period = 1'000'000'000 / 30;
+    int64_t next = now_ns();
+    for (int frame = 0; running; frame++)
+    {
+      const std::size_t shift = (frame * 4 * 997) % (noise.size() / 2);
+      for (auto& video : videos)
+        push_video(*video, {.bytes = noise.data() + shift, .width = o.width, .height = o.height});
+      next += period;
+      timespec ts{time_t(next / 1'000'000'000), long(next % 1'000'000'000)};
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+    }
+  }};
+
+  // What a host audio thread does, at the priority it would have
+  std::vector<int64_t> wake_late, push_time;
+  std::jthread audio_thread{[&] {
+    sched_param param{.sched_priority = 80};
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+      fprintf(stderr, "witchbridge-bench-jitter: no SCHED_FIFO, the callback runs unprioritized\n");
+
+    std::vector<float> left(o.frames), right(o.frames);
+    const int64_t period = int64_t(o.frames) * 1'000'000'000 / o.rate;
+    const int64_t warmup = 2 * int64_t(1'000'000'000) / period;
+    const int64_t blocks = int64_t(o.seconds) * 1'000'000'000 / period;
+    wake_late.reserve(blocks);
+    push_time.reserve(blocks);
+
+    double phase = 0.;
+    int64_t deadline = now_ns();
+    for (int64_t block = 0; block < warmup + blocks; block++)
+    {
+      deadline += period;
+      timespec ts{time_t(deadline / 1'000'000'000), long(deadline % 1'000'000'000)};
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+      const int64_t woke = now_ns();
+
+      for (int f = 0; f < o.frames; f++)
+      {
+        left[f] = right[f] = 0.25f * std::sin(phase);
+        phase += 2. * M_PI * 440. / o.rate;
+      }
+      push_audio<2, sample_format::f32>(
+          *audio, {.audio = {left.data(), right.data()}, .channels = 2, .frames = o.frames});
+      const int64_t done = now_ns();
+
+      if (block >= warmup)
+      {
+        wake_late.push_back(std::max<int64_t>(0, woke - deadline));
+        push_time.push_back(done - woke);
+      }
+    }
+    running = false;
+  }};
+  audio_thread.join();
+  video_thread.join();
+
+  printf(
+      "%d encoded video tracks at %dx%d, %d frames at %d Hz for %d s\n", o.viewers, o.width,
+      o.height, o.frames, o.rate, o.seconds);
+  const int64_t period = int64_t(o.frames) * 1'000'000'000 / o.rate;
+  const auto overruns = std::count_if(
+      wake_late.begin(), wake_late.end(), [&](int64_t late) { return late >= period; });
+  report("callback wake-up lateness", wake_late);
+  report("push_audio duration", push_time);
+  printf("callbacks late by a whole period or more: %lld\n", (long long)overruns);
+
+  videos.clear();
+  audio.reset();
+  return 0;
+}
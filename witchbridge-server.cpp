@@ -0,0 +1,65 @@
+#include "shm_ring.hpp"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Encodes and serves what a host writes into the shared memory it passes as
+// a file descriptor: witchbridge-server <fd>. The host starts it, and
+// restarts it when it exits, when config::out_of_process is set.
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <shared memory fd>\n", argv[0]);
+    return 1;
+  }
+
+  const int fd = atoi(argv[1]);
+  struct stat st{};
+  if (fstat(fd, &st) < 0 || std::size_t(st.st_size) < sizeof(shm_header))
+  {
+    fprintf(stderr, "witchbridge-server: no shared memory on fd %d\n", fd);
+    return 1;
+  }
+
+  const std::size_t size = st.st_size;
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED)
+  {
+    perror("witchbridge-server: mmap");
+    return 1;
+  }
+
+  auto& shm = *std::launder((shm_header*)memory);
+  if (shm.magic != shm_magic || shm.version != shm_version
+      || shm.size != sizeof(shm_header) || shm.total_size != size
+      || shm.total_size != shm_total_size(shm.frame_bytes))
+  {
+    fprintf(stderr, "witchbridge-server: built against another host version\n");
+    return 1;
+  }
+
+  // Blocked before any thread starts, so that only sigwait gets them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  shm.server_pid = getpid();
+  shm.server_starts++;
+  {
+    auto streamer = serve_shared_memory(config_from_json(shm.config_json), shm);
+    int signal{};
+    sigwait(&signals, &signal);
+  }
+
+  munmap(memory, size);
+  return 0;
+}